@@ -1,22 +1,38 @@
 """Python bindings for the libspng library."""
 
+import os
+import time
+
 import _pyspng_c as c
 import numpy as np
 from enum import IntEnum
-from typing import Optional
+from typing import BinaryIO, List, Optional, Sequence, Tuple, Union
 
 __version__ = c.__version__
 
+# The zlib implementation this build uses, e.g. "miniz 10.2.0"
+# or "zlib 1.3.1". Selected by PYSPNG_DEFLATE when building.
+deflate_backend = c.deflate_backend
+
+FilterChoice = Optional[Union[str, Sequence[str]]]
+
 class ProgressiveMode(IntEnum):
     NONE = 0
     PROGRESSIVE = 1
     INTERLACED = 2
 
 def encode(
-    image: np.ndarray, 
+    image: np.ndarray,
     progressive:ProgressiveMode = ProgressiveMode.NONE,
-    compress_level:int = 6
-) -> bytes:
+    compress_level:int = 6,
+    threads:int = 1,
+    filter:FilterChoice = None,
+    strategy:Optional[str] = None,
+    window_bits:int = 15,
+    mem_level:int = 8,
+    reduce:bool = False,
+    stats:bool = False,
+) -> Union[bytes, Tuple[bytes, dict]]:
     """
     Encode a Numpy array into a PNG bytestream.
 
@@ -32,15 +48,191 @@ def encode(
 
     Args:
         image (numpy.ndarray): A 2D image potentially with multiple channels.
-        progressive (int): 
+        progressive (int):
             0: off, regular PNG
             1: on, progressive PNG
             2: on, interlaced progressive PNG
 
             Use the ProgressiveMode enum class to make this more clear.
+        compress_level (int): 0-9 zlib compression level.
+        threads (int): Filter and deflate horizontal strips of a large
+            image on this many threads (0 means one per core). The
+            strips are stitched into a single standard PNG. Ignored
+            for interlaced images and images smaller than a few MB.
+        filter: Which PNG row filters to try, by the minimum sum of
+            absolute differences heuristic.
+            None: libspng's default, all of them unless compress_level is 0.
+            "none", "sub", "up", "avg", "paeth" or a list of these.
+            "all": try every filter on every row.
+            "fast": pick the single best filter for the whole image
+                from a sample of rows. Much faster to encode than "all",
+                usually at a small cost in size.
+        strategy: zlib compression strategy, "default", "filtered",
+            "huffman", "rle" or "fixed". None picks "filtered" when rows
+            are filtered and "default" otherwise.
+        window_bits (int): 9-15, log2 of the deflate window size.
+            Only 15 is supported when built with miniz.
+        mem_level (int): 1-9, memory used by deflate's match finder.
+            Higher is faster and compresses slightly better.
+        reduce (bool): Store 8-bit images in fewer bits when that is
+            lossless, at the cost of a pass over the pixels. Grayscale
+            whose values all fit in 1, 2 or 4 bits is written at that
+            bit depth and RGB or RGBA with at most 256 distinct colors
+            as an indexed PNG (with tRNS for alpha). load returns the
+            same array, except that indexed PNGs decode to RGB unless
+            format="RGBA" is given. Other images are written as usual.
+        stats (bool): Also return a dict of where the time went. See
+            "Instrumentation" in the README.
     Returns:
-        bytes: A valid PNG bytestream.
+        bytes: A valid PNG bytestream, or (bytes, dict) if stats.
+    """
+    start = time.perf_counter_ns()
+    image = _prepare_encode_input(image, compress_level)
+    options = _encode_options(compress_level, filter, strategy, window_bits, mem_level, reduce)
+    if not stats:
+        return c.spng_encode_image(image, progressive, options, threads)
+
+    # the input copy, if any, is made by _prepare_encode_input
+    input_ns = time.perf_counter_ns() - start
+    binary, call_stats = c.spng_encode_image(image, progressive, options, threads, True)
+    call_stats["input_ns"] += input_ns
+    call_stats["total_ns"] += input_ns
+    return binary, call_stats
+
+def encode_many(
+    images: Sequence[np.ndarray],
+    progressive:ProgressiveMode = ProgressiveMode.NONE,
+    compress_level:int = 6,
+    threads:int = 0,
+    errors:str = "raise",
+    filter:FilterChoice = None,
+    strategy:Optional[str] = None,
+    window_bits:int = 15,
+    mem_level:int = 8,
+    reduce:bool = False,
+) -> List[Union[bytes, Exception]]:
+    """
+    Encode a list of Numpy arrays into PNG bytestreams in parallel.
+
+    The GIL is released and the images are distributed over
+    a pool of native threads, so this is much faster than
+    calling encode in a loop on multi-core machines.
+
+    Args:
+        images: List of images, each as accepted by encode.
+        progressive: See encode.
+        compress_level: See encode.
+        threads: Number of worker threads. 0 means one per core.
+        errors:
+            "raise": raise the first error encountered (in input order).
+            "return": place a RuntimeError in the slot of each
+                image that failed to encode and continue.
+            Invalid options raise ValueError either way.
+        filter, strategy, window_bits, mem_level, reduce: See encode.
+
+    Returns:
+        list of bytes in the same order as the input.
+    """
+    if errors not in ("raise", "return"):
+        raise ValueError(f"errors must be 'raise' or 'return'. Got: {errors}")
+
+    images = [ _prepare_encode_input(image, compress_level) for image in images ]
+    options = _encode_options(compress_level, filter, strategy, window_bits, mem_level, reduce)
+    binaries, messages = c.spng_encode_many(images, progressive, options, threads)
+    return _collect_results(binaries, messages, errors)
+
+def save_file(
+    file: Union[str, os.PathLike, BinaryIO],
+    image: np.ndarray,
+    progressive:ProgressiveMode = ProgressiveMode.NONE,
+    compress_level:int = 6,
+    threads:int = 1,
+    filter:FilterChoice = None,
+    strategy:Optional[str] = None,
+    window_bits:int = 15,
+    mem_level:int = 8,
+    reduce:bool = False,
+) -> None:
+    """
+    Encode a Numpy array into a PNG file.
+
+    The PNG is streamed out through a fixed size buffer as it is
+    compressed instead of being built in memory first, and the GIL is
+    released while encoding. If encoding to a path fails, the partially
+    written file is removed.
+
+    Args:
+        file: Destination path or a binary file-like object with
+            a write method. A write that returns 0, or None from a
+            non-blocking raw stream, raises OSError.
+        image, progressive, compress_level, threads: See encode.
+            With threads > 1 the compressed strips are held in
+            memory until all of them are done.
+        filter, strategy, window_bits, mem_level, reduce: See encode.
+
+    Raises:
+        OSError: If the path can't be opened or written.
     """
+    image = _prepare_encode_input(image, compress_level)
+    options = _encode_options(compress_level, filter, strategy, window_bits, mem_level, reduce)
+    if _is_path(file):
+        c.spng_encode_file(os.fspath(file), image, progressive, options, threads)
+    else:
+        c.spng_encode_stream(file, image, progressive, options, threads)
+
+_FILTER_CHOICES = {
+    "none": c.SPNG_FILTER_CHOICE_NONE,
+    "sub": c.SPNG_FILTER_CHOICE_SUB,
+    "up": c.SPNG_FILTER_CHOICE_UP,
+    "avg": c.SPNG_FILTER_CHOICE_AVG,
+    "paeth": c.SPNG_FILTER_CHOICE_PAETH,
+    "all": c.SPNG_FILTER_CHOICE_ALL,
+}
+
+_STRATEGIES = {
+    "default": 0,
+    "filtered": 1,
+    "huffman": 2,
+    "rle": 3,
+    "fixed": 4,
+}
+
+def _encode_options(
+    compress_level:int,
+    filter:FilterChoice,
+    strategy:Optional[str],
+    window_bits:int,
+    mem_level:int,
+    reduce:bool,
+) -> c.EncodeOptions:
+    if filter is None:
+        filter_choice = -1
+    elif filter == "fast":
+        filter_choice = c.FILTER_CHOICE_FAST
+    else:
+        names = [ filter ] if isinstance(filter, str) else list(filter)
+        if len(names) == 0:
+            raise ValueError("filter must name at least one filter.")
+        filter_choice = 0
+        for name in names:
+            if name not in _FILTER_CHOICES:
+                raise ValueError(
+                    f"filter must be one of {', '.join(_FILTER_CHOICES)} or 'fast'. Got: {name}"
+                )
+            filter_choice |= int(_FILTER_CHOICES[name])
+
+    if strategy is None:
+        zstrategy = -1
+    elif strategy in _STRATEGIES:
+        zstrategy = _STRATEGIES[strategy]
+    else:
+        raise ValueError(f"strategy must be one of {', '.join(_STRATEGIES)}. Got: {strategy}")
+
+    options = c.EncodeOptions(compress_level, filter_choice, zstrategy, window_bits, mem_level, bool(reduce))
+    options.validate()
+    return options
+
+def _prepare_encode_input(image: np.ndarray, compress_level:int) -> np.ndarray:
     if image.size == 0:
         raise ValueError("Cannot encode an empty PNG.")
     if not (0 <= compress_level <= 9):
@@ -48,52 +240,93 @@ def encode(
 
     byte_width = np.dtype(image.dtype).itemsize
     kind = np.dtype(image.dtype).kind
-    num_channels = 1 if image.ndim < 3 else image.shape[2]
 
     if byte_width > 2 or kind != 'u':
         raise TypeError(f"The PNG format only supports up to unsigned 16-bit integers. Got: {image.dtype}")
 
-    pair = (num_channels, byte_width)
+    return np.ascontiguousarray(image)
 
-    # See: https://github.com/randy408/libspng/blob/master/docs/decode.md#supported-format-flag-combinations
-    unsupported = set([ 
-        (1, 2), # G16
-        (3, 2), # RGB16
-    ])
+def _collect_results(results:list, messages:list, errors:str) -> list:
+    for i, msg in enumerate(messages):
+        if msg is None:
+            continue
+        if errors == "raise":
+            raise RuntimeError(f"item {i}: {msg}")
+        results[i] = RuntimeError(msg)
+    return results
 
-    if pair in unsupported:
-        raise TypeError(
-            f"This channel number and byte width are unsupported. byte_width: {byte_width} num_channels: {num_channels}"
-            f"See: https://github.com/randy408/libspng/blob/master/docs/decode.md#supported-format-flag-combinations"
-        )
+BytesLike = Union[bytes, bytearray, memoryview]
 
-    return c.spng_encode_image(
-        np.ascontiguousarray(image), 
-        progressive, 
-        compress_level
-    )
-
-def header(data: bytes) -> dict:
+def header(data: BytesLike) -> dict:
     """
     Read the PNG ihdr header.
+
+    data can be any bytes-like object (bytes, bytearray,
+    memoryview, mmap, ...) and is not copied.
     """
     return c.spng_read_header(data)
 
-def load(data: bytes, format: Optional[str] = None) -> np.ndarray:
+def load(
+    data: BytesLike,
+    format: Optional[str] = None,
+    out: Optional[np.ndarray] = None,
+    region: Optional[Tuple[int, int, int, int]] = None,
+    max_pass: Optional[int] = None,
+    nearest_fill: bool = False,
+    stats: bool = False,
+    raw_indices: bool = False,
+) -> Union[np.ndarray, Tuple[np.ndarray, dict], Tuple[np.ndarray, np.ndarray]]:
     """
     Load a PNG from a bytes object and return the image data as
     a np.ndarray.
 
     The output `format`, if specified, can be one of "L", "LA", "RGB", "RGBA".
     If left unspecified, automatically determine it by looking at the PNG ihdr
-    block.
+    block. Indexed (palette) PNGs decode to RGB by default; "RGBA" also
+    applies the palette's transparency.
 
     Args:
-        data (bytes): PNG data
+        data (bytes-like): PNG data. Any C-contiguous buffer protocol
+            object (bytes, bytearray, memoryview, mmap, ...) is decoded
+            in place without being copied.
         format (str, optional): Output pixel format.  Auto-detect if None.
+        out (numpy.ndarray, optional): Decode directly into this preallocated
+            writable numpy array instead of allocating a new one. It must have
+            the decoded shape and dtype in native byte order (shape
+            `[height,width]` is accepted for grayscale) but may be strided,
+            e.g. a view into a larger volume.
+        region (tuple, optional): `(y0, y1, x0, x1)` decodes only rows
+            `y0 <= y < y1` and columns `x0 <= x < x1`, equivalent to
+            `load(data)[y0:y1, x0:x1]` but only the crop is allocated.
+            Rows above y0 still have to be inflated, but inflating stops
+            as soon as the last requested row is complete, so crops near
+            the top of a large image are much cheaper than a full decode.
+            (Adam7 interlaced images must be inflated into the last pass.)
+            If out is given, it must have the shape of the region.
+        max_pass (int, optional): 1-7. Return a reduced resolution preview
+            made of the pixels in Adam7 passes 1 to max_pass. For interlaced
+            PNGs, inflating stops when pass max_pass + 1 begins, so e.g.
+            max_pass=1 reads only ~1/64th of the image data. By default
+            the preview is the image subsampled on the grid those passes
+            cover: every 8th row and column for pass 1, then (8,4), (4,4),
+            (4,2), (2,2), (2,1) and (1,1) (rows, columns) for passes 2-7.
+            Non-interlaced PNGs give the same result but must be inflated
+            down to the last grid row. Cannot be combined with out or region.
+        nearest_fill (bool): With max_pass, return a full size image with
+            each preview pixel repeated over the block it stands for
+            instead of the subsampled grid.
+        stats (bool): Also return a dict of per-stage nanosecond timings,
+            byte counts and the filter type of each scanline. See
+            "Instrumentation" in the README.
+        raw_indices (bool): For indexed (palette) PNGs, return
+            `(indices, palette)` instead of the colors: the uint8 palette
+            index of every pixel in shape `[height,width]`, whatever the
+            PNG's bit depth, and the uint8 palette in shape `[n,3]`, or
+            `[n,4]` if the PNG has transparency. Raises ValueError for
+            other PNGs. Cannot be combined with the other options.
 
     Returns:
-        numpy.ndarray: Image data as a numpy array.
+        numpy.ndarray: Image data as a numpy array, or (array, dict) if stats.
 
         The resulting array will have shape `[height,width,channels]` if channels > 1,
         or `[height,width]` for grayscale images.
@@ -101,6 +334,173 @@ def load(data: bytes, format: Optional[str] = None) -> np.ndarray:
         The array dtype is either :obj:`np.uint8` or :obj:`np.uint16`, depending the desired
         output `format`, or if unspecified, depending on PNG contents.
     """
+    if raw_indices:
+        if format is not None or out is not None or region is not None or max_pass is not None or stats:
+            raise ValueError("raw_indices cannot be combined with format, out, region, max_pass or stats.")
+        indices, palette = c.spng_decode_image_indices(data)
+        return _squeeze_channels(indices), palette
+
+    region = _region(region)
+    max_pass = _max_pass(max_pass, out, region)
+
+    if out is not None:
+        result = c.spng_decode_image_into(data, _spng_format(format), out, region, stats)
+        return result if stats else out
+
+    result = c.spng_decode_image_bytes(
+        data, _spng_format(format), region, max_pass, nearest_fill, stats
+    )
+    if stats:
+        arr, call_stats = result
+        return _squeeze_channels(arr), call_stats
+    return _squeeze_channels(result)
+
+def load_file(
+    file: Union[str, os.PathLike, BinaryIO],
+    format: Optional[str] = None,
+    out: Optional[np.ndarray] = None,
+    region: Optional[Tuple[int, int, int, int]] = None,
+    max_pass: Optional[int] = None,
+    nearest_fill: bool = False,
+) -> np.ndarray:
+    """
+    Load a PNG from a file and return the image data as a np.ndarray.
+
+    The file is read through a fixed size buffer while it is being
+    decoded rather than loaded into memory first, and the GIL is
+    released while decoding. With region or max_pass, reading stops
+    once the last requested row or pass has been decoded.
+
+    Args:
+        file: Path or a binary file-like object with a read method.
+        format, out, region, max_pass, nearest_fill: See load.
+
+    Returns:
+        numpy.ndarray: See load.
+
+    Raises:
+        OSError: If the path can't be opened, e.g. FileNotFoundError.
+    """
+    region = _region(region)
+    max_pass = _max_pass(max_pass, out, region)
+    if _is_path(file):
+        arr = c.spng_decode_file(
+            os.fspath(file), _spng_format(format), out, region, max_pass, nearest_fill
+        )
+    else:
+        arr = c.spng_decode_stream(
+            file, _spng_format(format), out, region, max_pass, nearest_fill
+        )
+
+    if out is not None:
+        return out
+    return _squeeze_channels(arr)
+
+def _is_path(file) -> bool:
+    return isinstance(file, (str, bytes, os.PathLike))
+
+def load_many(
+    datas: Sequence[BytesLike],
+    format: Optional[str] = None,
+    threads: int = 0,
+    errors: str = "raise",
+) -> List[Union[np.ndarray, Exception]]:
+    """
+    Decode a list of PNG bytes objects into numpy arrays in parallel.
+
+    The GIL is released and the images are distributed over
+    a pool of native threads, so this is much faster than
+    calling load in a loop on multi-core machines.
+
+    Args:
+        datas: List of PNG bytestreams (any bytes-like objects).
+        format (str, optional): Output pixel format applied to every
+            image. See load.
+        threads: Number of worker threads. 0 means one per core.
+        errors:
+            "raise": raise the first error encountered (in input order).
+            "return": place a RuntimeError in the slot of each
+                image that failed to decode and continue.
+
+    Returns:
+        list of numpy.ndarray in the same order as the input.
+    """
+    if errors not in ("raise", "return"):
+        raise ValueError(f"errors must be 'raise' or 'return'. Got: {errors}")
+
+    arrs, messages = c.spng_decode_many(list(datas), _spng_format(format), threads)
+    arrs = [
+        (arr if arr is None else _squeeze_channels(arr))
+        for arr in arrs
+    ]
+    return _collect_results(arrs, messages, errors)
+
+class IncrementalDecoder:
+    """
+    Decode a PNG while it is still arriving, e.g. over the network.
+
+    Each chunk passed to feed is handed to a background thread which
+    parses the header and inflates and unfilters rows as soon as enough
+    of their compressed data is available, so most of the decoding
+    overlaps with the transfer.
+
+    Example:
+        decoder = pyspng.IncrementalDecoder()
+        for chunk in response.iter_content(65536):
+            decoder.feed(chunk)
+            print(decoder.rows_complete)
+        image = decoder.finish()
+
+    Adam7 interlaced images fill in the whole frame a pass at a time,
+    so their rows only become complete during the final pass.
+    """
+    def __init__(self, format: Optional[str] = None):
+        """format: Output pixel format. See load."""
+        self._decoder = c.IncrementalDecoder(_spng_format(format))
+
+    def feed(self, data: BytesLike) -> None:
+        """
+        Append the next piece of the PNG. The data is copied.
+
+        Raises the decoding error early if the data
+        received so far is already known to be invalid.
+        """
+        self._decoder.feed(data)
+
+    def finish(self) -> np.ndarray:
+        """
+        Signal that all data has been fed, wait for decoding to
+        complete and return the image as load would.
+        """
+        return _squeeze_channels(self._decoder.finish())
+
+    @property
+    def header(self) -> Optional[dict]:
+        """The PNG ihdr header (see header()), or None until it has arrived."""
+        return self._decoder.header
+
+    @property
+    def rows_complete(self) -> int:
+        """Number of leading rows of the image that are fully decoded."""
+        return self._decoder.rows_complete
+
+    @property
+    def done(self) -> bool:
+        """Whether decoding has ended, successfully or with an error."""
+        return self._decoder.done
+
+    def partial_image(self) -> Optional[np.ndarray]:
+        """
+        The image as decoded so far, or None until the header has
+        arrived. This is a live view: the first rows_complete rows are
+        final and the remaining rows are zero or still being filled in.
+        """
+        image = self._decoder.image
+        if image is None:
+            return None
+        return _squeeze_channels(image)
+
+def _spng_format(format: Optional[str]):
     # TODO 16 bit variants?
     cfmts = {
         'L': c.SPNG_FMT_G8,
@@ -108,8 +508,28 @@ def load(data: bytes, format: Optional[str] = None) -> np.ndarray:
         'RGB': c.SPNG_FMT_RGB8,
         'RGBA': c.SPNG_FMT_RGBA8,
     }
-    cfmt = cfmts[format] if format is not None else c.SPNG_FMT_AUTO
-    arr = c.spng_decode_image_bytes(data, cfmt)
+    return cfmts[format] if format is not None else c.SPNG_FMT_AUTO
+
+def _region(region):
+    if region is None:
+        return None
+    region = tuple(int(v) for v in region)
+    if len(region) != 4:
+        raise ValueError(f"region must be (y0, y1, x0, x1). Got: {region}")
+    if any(v < 0 for v in region):
+        raise ValueError(f"region bounds must be non-negative. Got: {region}")
+    return region
+
+def _max_pass(max_pass, out, region) -> int:
+    if max_pass is None:
+        return 0
+    if not (1 <= max_pass <= 7):
+        raise ValueError(f"max_pass must be between 1 and 7 inclusive. Got: {max_pass}")
+    if out is not None or region is not None:
+        raise ValueError("max_pass cannot be combined with out or region.")
+    return int(max_pass)
+
+def _squeeze_channels(arr: np.ndarray) -> np.ndarray:
     if arr.shape[2] == 1:  # HWC => HW
         return arr[:,:,0]
     return arr
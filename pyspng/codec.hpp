@@ -0,0 +1,828 @@
+/*
+ * Core libspng decode/encode routines shared by the Python bindings.
+ *
+ * Nothing in this file touches the Python C API, so every function here
+ * is safe to call with the GIL released and from worker threads. Each
+ * call creates its own spng_ctx.
+ */
+
+#ifndef __PYSPNG_CODEC_HPP__
+#define __PYSPNG_CODEC_HPP__
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+#ifdef SPNG_USE_MINIZ
+    #include "miniz.h"
+#else
+    #include <zlib.h>
+#endif
+
+#include "spng.h"
+
+#include "filters.hpp"
+#include "stats.hpp"
+
+namespace pyspng {
+
+enum ProgressiveMode {
+    PROGRESSIVE_MODE_NONE = 0,
+    PROGRESSIVE_MODE_PROGRESSIVE = 1,
+    PROGRESSIVE_MODE_INTERLACED = 2
+};
+
+// The deflate/inflate implementation libspng and the strip encoder
+// were built against, see PYSPNG_DEFLATE in setup.py.
+inline std::string deflate_backend() {
+#ifdef SPNG_USE_MINIZ
+    return std::string("miniz ") + MZ_VERSION;
+#else
+    return std::string("zlib ") + zlibVersion();
+#endif
+}
+
+typedef std::unique_ptr<spng_ctx, void(*)(spng_ctx*)> spng_ctx_ptr;
+
+inline spng_ctx_ptr new_ctx(const int flags) {
+    spng_ctx_ptr ctx(spng_ctx_new(flags), spng_ctx_free);
+    if (!ctx) {
+        throw std::runtime_error("pyspng: unable to allocate spng context.");
+    }
+    return ctx;
+}
+
+// A decoded image in a malloc'd buffer owned by the caller.
+struct DecodedImage {
+    void *data;
+    size_t height;
+    size_t width;
+    size_t channels;
+    size_t sample_bytes; // 1 or 2
+};
+
+// PLTE entries, plus tRNS if any entry isn't opaque.
+struct Palette {
+    size_t size;
+    uint8_t rgba[256][4];
+    bool has_alpha;
+};
+
+// A C-contiguous HWC image to be encoded.
+//
+// packed_bits is zero for samples of sample_bytes each. Otherwise
+// data holds the PNG's own packed scanlines (without filter bytes)
+// at that bit depth and palette, if not NULL, makes them palette
+// indices. See palette.hpp.
+struct ImageView {
+    const void *data;
+    size_t height;
+    size_t width;
+    size_t channels;
+    size_t sample_bytes; // 1 or 2
+    size_t packed_bits; // 0, 1, 2, 4 or 8
+    const Palette *palette;
+
+    size_t bit_depth() const {
+        return packed_bits ? packed_bits : sample_bytes * 8;
+    }
+
+    size_t row_bytes() const {
+        return (width * channels * bit_depth() + 7) / 8;
+    }
+
+    // Distance the PNG filters look back, at least a byte.
+    size_t filter_bpp() const {
+        return std::max(static_cast<size_t>(1), channels * bit_depth() / 8);
+    }
+
+    size_t nbytes() const {
+        return height * row_bytes();
+    }
+};
+
+inline uint8_t png_color_type(const ImageView &image) {
+    if (image.palette) {
+        return SPNG_COLOR_TYPE_INDEXED;
+    }
+    switch (image.channels) {
+        case 1: return SPNG_COLOR_TYPE_GRAYSCALE;
+        case 2: return SPNG_COLOR_TYPE_GRAYSCALE_ALPHA;
+        case 3: return SPNG_COLOR_TYPE_TRUECOLOR;
+        case 4: return SPNG_COLOR_TYPE_TRUECOLOR_ALPHA;
+        default: throw std::runtime_error("pyspng: Too many channels in image.");
+    }
+}
+
+inline spng_ihdr read_ihdr(const void *buf, const size_t len) {
+    spng_ctx_ptr ctx = new_ctx(0);
+
+    spng_set_png_buffer(ctx.get(), buf, len);
+
+    struct spng_ihdr ihdr;
+    int res;
+    if ((res = spng_get_ihdr(ctx.get(), &ihdr)) != SPNG_OK) {
+        throw std::runtime_error("pyspng: could not decode ihdr: " + std::string(spng_strerror(res)));
+    }
+
+    return ihdr;
+}
+
+// An opened PNG whose IHDR has been read and whose
+// output layout has been decided, ready to be decoded.
+struct DecodePlan {
+    spng_ctx_ptr ctx;
+    struct spng_ihdr ihdr;
+    int render_fmt;
+    int decode_flags; // e.g. SPNG_DECODE_TRNS
+    size_t channels;
+    size_t sample_bytes; // 1 or 2
+    size_t out_size;
+
+    DecodePlan() : ctx(NULL, spng_ctx_free) {}
+
+    size_t row_bytes() const {
+        return static_cast<size_t>(ihdr.width) * channels * sample_bytes;
+    }
+};
+
+inline spng_ctx_ptr new_decoder() {
+    spng_ctx_ptr ctx = new_ctx(0);
+
+    // Ignore and don't calculate chunk CRC's
+    spng_set_crc_action(ctx.get(), SPNG_CRC_USE, SPNG_CRC_USE);
+
+    // Set memory usage limits for storing standard and unknown chunks,
+    // this is important when reading arbitrary files!
+    size_t limit = 1024 * 1024 * 64;
+    spng_set_chunk_limits(ctx.get(), limit, limit);
+
+    return ctx;
+}
+
+// Samples per pixel of a PNG color type (palette indices count as one).
+inline size_t png_channels(const uint8_t color_type) {
+    switch (color_type) {
+        case SPNG_COLOR_TYPE_GRAYSCALE_ALPHA: return 2;
+        case SPNG_COLOR_TYPE_TRUECOLOR: return 3;
+        case SPNG_COLOR_TYPE_TRUECOLOR_ALPHA: return 4;
+        default: return 1;
+    }
+}
+
+// Reads the IHDR from a decoder whose source is already set.
+inline DecodePlan plan_decode(spng_ctx_ptr decoder, const int fmt) {
+    DecodePlan plan;
+    plan.ctx = std::move(decoder);
+    spng_ctx *ctx = plan.ctx.get();
+
+    struct spng_ihdr &ihdr = plan.ihdr;
+    int res;
+    if ((res = spng_get_ihdr(ctx, &ihdr)) != SPNG_OK) {
+        throw std::runtime_error("pyspng: could not decode ihdr: " + std::string(spng_strerror(res)));
+    }
+
+    // Decide spng_format based on ihdr.
+    //
+    // libspng has no G16 or RGB16 output format, but SPNG_FMT_PNG
+    // decodes to the image's own layout with 16-bit samples in host
+    // byte order, so 16-bit grayscale and RGB don't need an alpha
+    // channel allocated and then dropped.
+    //
+    // An issue in libspng also prevents direct rendering of GA8 and GA16,
+    // see: https://github.com/randy408/libspng/issues/207
+    //
+    // Indexed PNGs decode to RGB8. Asking for RGBA8 applies the
+    // palette's alpha from tRNS, if there is one.
+    int render_fmt = fmt;
+    if (fmt == 0) {
+        switch (ihdr.color_type) {
+            case SPNG_COLOR_TYPE_GRAYSCALE:
+                render_fmt = ihdr.bit_depth <= 8 ? SPNG_FMT_G8 : SPNG_FMT_PNG;
+                break;
+            case SPNG_COLOR_TYPE_TRUECOLOR:
+                render_fmt = ihdr.bit_depth <= 8 ? SPNG_FMT_RGB8 : SPNG_FMT_PNG;
+                break;
+            case SPNG_COLOR_TYPE_INDEXED:
+                render_fmt = SPNG_FMT_RGB8;
+                break;
+            case SPNG_COLOR_TYPE_GRAYSCALE_ALPHA:
+                render_fmt = SPNG_FMT_PNG;
+                break;
+            case SPNG_COLOR_TYPE_TRUECOLOR_ALPHA:
+                render_fmt = ihdr.bit_depth <= 8 ? SPNG_FMT_RGBA8 : SPNG_FMT_RGBA16;
+                break;
+        }
+    }
+
+    const int decode_flags = (ihdr.color_type == SPNG_COLOR_TYPE_INDEXED && render_fmt == SPNG_FMT_RGBA8)
+        ? SPNG_DECODE_TRNS
+        : 0;
+
+    size_t nc; // num channels
+    size_t cs; // channel stride
+    switch (render_fmt) {
+        case SPNG_FMT_RGBA8:    nc = 4; cs = 1; break;
+        case SPNG_FMT_RGBA16:   nc = 4; cs = 2; break;
+        case SPNG_FMT_RGB8:     nc = 3; cs = 1; break;
+        case SPNG_FMT_GA8:      nc = 2; cs = 1; break;
+        case SPNG_FMT_GA16:     nc = 2; cs = 2; break;
+        case SPNG_FMT_G8:       nc = 1; cs = 1; break;
+        case SPNG_FMT_PNG:
+            if (ihdr.color_type == SPNG_COLOR_TYPE_INDEXED || ihdr.bit_depth < 8) {
+                throw std::runtime_error("pyspng: invalid output fmt");
+            }
+            nc = png_channels(ihdr.color_type);
+            cs = ihdr.bit_depth / 8;
+            break;
+        default:
+            throw std::runtime_error("pyspng: invalid output fmt");
+    }
+
+    if ((res = spng_decoded_image_size(ctx, render_fmt, &plan.out_size)) != SPNG_OK) {
+        throw std::runtime_error("pyspng: could not decode image size: " + std::string(spng_strerror(res)));
+    }
+
+    plan.render_fmt = render_fmt;
+    plan.decode_flags = decode_flags;
+    plan.channels = nc;
+    plan.sample_bytes = cs;
+    return plan;
+}
+
+inline DecodePlan plan_decode(const void *buf, const size_t len, const int fmt) {
+    spng_ctx_ptr ctx = new_decoder();
+    spng_set_png_buffer(ctx.get(), buf, len);
+    return plan_decode(std::move(ctx), fmt);
+}
+
+// Streams the PNG through read_fn, which libspng calls
+// for at most 8 KB at a time.
+inline DecodePlan plan_decode(spng_read_fn *read_fn, void *user, const int fmt) {
+    spng_ctx_ptr ctx = new_decoder();
+    spng_set_png_stream(ctx.get(), read_fn, user);
+    return plan_decode(std::move(ctx), fmt);
+}
+
+inline DecodePlan plan_decode(FILE *file, const int fmt) {
+    spng_ctx_ptr ctx = new_decoder();
+    spng_set_png_file(ctx.get(), file);
+    return plan_decode(std::move(ctx), fmt);
+}
+
+inline DecodedImage decode(DecodePlan &plan) {
+    void* data = malloc(plan.out_size);
+    if (data == NULL) {
+        throw std::runtime_error("pyspng: unable to allocate " + std::to_string(plan.out_size) + " bytes.");
+    }
+
+    int res;
+    if ((res = spng_decode_image(plan.ctx.get(), data, plan.out_size, plan.render_fmt, plan.decode_flags)) != SPNG_OK) {
+        free(data);
+        throw std::runtime_error("pyspng: could not decode image: " + std::string(spng_strerror(res)));
+    }
+
+    DecodedImage image;
+    image.data = data;
+    image.height = plan.ihdr.height;
+    image.width = plan.ihdr.width;
+    image.channels = plan.channels;
+    image.sample_bytes = plan.sample_bytes;
+    return image;
+}
+
+inline DecodedImage decode(const void *buf, const size_t len, const int fmt) {
+    DecodePlan plan = plan_decode(buf, len, fmt);
+    return decode(plan);
+}
+
+// Rows [y0, y1) and columns [x0, x1) of an image.
+struct Region {
+    size_t y0;
+    size_t y1;
+    size_t x0;
+    size_t x1;
+
+    size_t height() const {
+        return y1 - y0;
+    }
+
+    size_t width() const {
+        return x1 - x0;
+    }
+};
+
+inline Region full_region(const DecodePlan &plan) {
+    Region region = { 0, plan.ihdr.height, 0, plan.ihdr.width };
+    return region;
+}
+
+inline void check_region(const DecodePlan &plan, const Region &region) {
+    if (
+        region.y0 >= region.y1 || region.y1 > plan.ihdr.height
+        || region.x0 >= region.x1 || region.x1 > plan.ihdr.width
+    ) {
+        throw std::invalid_argument(
+            "pyspng: region (" + std::to_string(region.y0) + ", " + std::to_string(region.y1)
+            + ", " + std::to_string(region.x0) + ", " + std::to_string(region.x1)
+            + ") is empty or out of bounds for an image of height " + std::to_string(plan.ihdr.height)
+            + " and width " + std::to_string(plan.ihdr.width) + "."
+        );
+    }
+}
+
+// A caller allocated, possibly strided, HWC destination.
+// Strides are in bytes.
+struct OutputView {
+    void *data;
+    ptrdiff_t strides[3];
+
+    bool is_contiguous(const DecodePlan &plan) const {
+        const ptrdiff_t cs = plan.sample_bytes;
+        return strides[2] == cs
+            && strides[1] == static_cast<ptrdiff_t>(plan.channels) * cs
+            && strides[0] == static_cast<ptrdiff_t>(plan.row_bytes());
+    }
+};
+
+// Adam7 column origin and spacing of each pass.
+const uint8_t ADAM7_X_START[7] = { 0, 4, 0, 2, 0, 1, 0 };
+const uint8_t ADAM7_X_DELTA[7] = { 8, 8, 4, 4, 2, 2, 1 };
+
+// Copies columns x_start, x_start + x_step, ... that fall inside
+// the region from a full width decoded row into row y - region.y0
+// of a strided destination.
+inline void scatter_row(
+    const DecodePlan &plan, const OutputView &out, const Region &region,
+    const size_t y, const uint8_t *row,
+    const size_t x_start = 0, const size_t x_step = 1
+) {
+    const size_t nc = plan.channels;
+    const size_t cs = plan.sample_bytes;
+    const size_t bpp = nc * cs;
+
+    size_t x = x_start;
+    if (x < region.x0) {
+        x += (region.x0 - x + x_step - 1) / x_step * x_step;
+    }
+
+    uint8_t *dest_row = static_cast<uint8_t*>(out.data)
+        + static_cast<ptrdiff_t>(y - region.y0) * out.strides[0];
+
+    if (x_step == 1 && out.strides[2] == static_cast<ptrdiff_t>(cs) && out.strides[1] == static_cast<ptrdiff_t>(bpp)) {
+        memcpy(dest_row + (x - region.x0) * bpp, row + x * bpp, (region.x1 - x) * bpp);
+        return;
+    }
+
+    for (; x < region.x1; x += x_step) {
+        uint8_t *dest_px = dest_row + static_cast<ptrdiff_t>(x - region.x0) * out.strides[1];
+        const uint8_t *src_px = row + x * bpp;
+        for (size_t c = 0; c < nc; c++) {
+            memcpy(dest_px + static_cast<ptrdiff_t>(c) * out.strides[2], src_px + c * cs, cs);
+        }
+    }
+}
+
+// Decodes the region of the image into a caller allocated array of
+// shape (region height, region width, channels).
+//
+// Anything other than a contiguous full image is decoded a row at a
+// time: rows above the region are inflated into a scratch row and
+// dropped, and inflating stops as soon as the last row of the region
+// is complete. For Adam7 images that is during the final pass, since
+// every pass spans the whole height.
+inline void decode_into(DecodePlan &plan, const OutputView &out, const Region &region) {
+    int res;
+    spng_ctx *ctx = plan.ctx.get();
+
+    check_region(plan, region);
+
+    const size_t height = plan.ihdr.height;
+    const size_t width = plan.ihdr.width;
+    const bool full = region.y0 == 0 && region.y1 == height
+        && region.x0 == 0 && region.x1 == width;
+
+    if (full && out.is_contiguous(plan)) {
+        if ((res = spng_decode_image(ctx, out.data, plan.out_size, plan.render_fmt, plan.decode_flags)) != SPNG_OK) {
+            throw std::runtime_error("pyspng: could not decode image: " + std::string(spng_strerror(res)));
+        }
+        return;
+    }
+
+    if ((res = spng_decode_image(ctx, NULL, 0, plan.render_fmt, plan.decode_flags | SPNG_DECODE_PROGRESSIVE)) != SPNG_OK) {
+        throw std::runtime_error("pyspng: could not decode image: " + std::string(spng_strerror(res)));
+    }
+
+    const size_t row_bytes = plan.row_bytes();
+    std::unique_ptr<uint8_t[]> row(new uint8_t[row_bytes]());
+
+    if (plan.ihdr.interlace_method == SPNG_INTERLACE_NONE) {
+        for (size_t y = 0; y < region.y1; y++) {
+            res = spng_decode_row(ctx, row.get(), row_bytes);
+            if (res != SPNG_OK && res != SPNG_EOI) {
+                throw std::runtime_error("pyspng: could not decode image: " + std::string(spng_strerror(res)));
+            }
+            if (y >= region.y0) {
+                scatter_row(plan, out, region, y, row.get());
+            }
+        }
+        return;
+    }
+
+    // Row info describes the row the next call will decode.
+    struct spng_row_info row_info;
+    do {
+        if ((res = spng_get_row_info(ctx, &row_info)) != SPNG_OK) {
+            break;
+        }
+        if (row_info.pass == 6 && row_info.row_num >= region.y1) {
+            return;
+        }
+
+        res = spng_decode_row(ctx, row.get(), row_bytes);
+        if (res != SPNG_OK && res != SPNG_EOI) {
+            break;
+        }
+
+        if (row_info.row_num >= region.y0 && row_info.row_num < region.y1) {
+            scatter_row(
+                plan, out, region, row_info.row_num, row.get(),
+                ADAM7_X_START[row_info.pass], ADAM7_X_DELTA[row_info.pass]
+            );
+        }
+    } while (res == SPNG_OK);
+
+    if (res != SPNG_EOI) {
+        throw std::runtime_error("pyspng: could not decode image: " + std::string(spng_strerror(res)));
+    }
+}
+
+inline void decode_into(DecodePlan &plan, const OutputView &out) {
+    decode_into(plan, out, full_region(plan));
+}
+
+// Decodes only the given rows and columns into a new malloc'd buffer.
+inline DecodedImage decode_region(DecodePlan &plan, const Region &region) {
+    check_region(plan, region);
+
+    const size_t nc = plan.channels;
+    const size_t cs = plan.sample_bytes;
+    const size_t nbytes = region.height() * region.width() * nc * cs;
+
+    void* data = malloc(nbytes);
+    if (data == NULL) {
+        throw std::runtime_error("pyspng: unable to allocate " + std::to_string(nbytes) + " bytes.");
+    }
+
+    OutputView out;
+    out.data = data;
+    out.strides[0] = static_cast<ptrdiff_t>(region.width() * nc * cs);
+    out.strides[1] = static_cast<ptrdiff_t>(nc * cs);
+    out.strides[2] = static_cast<ptrdiff_t>(cs);
+
+    try {
+        decode_into(plan, out, region);
+    }
+    catch (...) {
+        free(data);
+        throw;
+    }
+
+    DecodedImage image;
+    image.data = data;
+    image.height = region.height();
+    image.width = region.width();
+    image.channels = nc;
+    image.sample_bytes = cs;
+    return image;
+}
+
+inline DecodedImage decode_region(const void *buf, const size_t len, const int fmt, const Region &region) {
+    DecodePlan plan = plan_decode(buf, len, fmt);
+    return decode_region(plan, region);
+}
+
+// Destination for encoded PNG bytes. write() reports failure by throwing.
+class ByteSink {
+public:
+    virtual ~ByteSink() {}
+    virtual void write(const void *src, size_t len) = 0;
+
+    // Why the last write failed, if it was made through libspng.
+    std::exception_ptr error;
+};
+
+// Writes land in a caller supplied buffer (e.g. the storage of a
+// freshly allocated Python bytes object) and only spill into an
+// internal string if that buffer is too small.
+struct PngSink : public ByteSink {
+    unsigned char *buf;
+    size_t capacity;
+    size_t size;
+    std::string spill;
+
+    PngSink() : buf(NULL), capacity(0), size(0) {}
+    PngSink(void *buf_, const size_t capacity_)
+        : buf(static_cast<unsigned char*>(buf_)), capacity(capacity_), size(0) {}
+
+    void write(const void *src, size_t len) override {
+        const unsigned char *bytes = static_cast<const unsigned char*>(src);
+        if (spill.empty()) {
+            const size_t fits = std::min(len, capacity - size);
+            if (fits) {
+                memcpy(buf + size, bytes, fits);
+            }
+            size += fits;
+            bytes += fits;
+            len -= fits;
+        }
+        if (len) {
+            spill.append(reinterpret_cast<const char*>(bytes), len);
+        }
+    }
+
+    size_t total() const {
+        return size + spill.size();
+    }
+};
+
+inline int png_sink_write_fn(spng_ctx *ctx, void *user, void *src, size_t length) {
+    (void)ctx;
+    ByteSink *sink = static_cast<ByteSink*>(user);
+    try {
+        sink->write(src, length);
+    }
+    catch (const std::exception &) {
+        sink->error = std::current_exception();
+        return SPNG_IO_ERROR;
+    }
+    return 0;
+}
+
+// Upper bound on the size of the PNG libspng (or the strip encoder)
+// produces for this image, used to preallocate the output so it is
+// written exactly once. Based on miniz's mz_deflateBound.
+inline size_t max_encoded_size(const ImageView &image) {
+    const size_t row_bytes = image.row_bytes();
+    // Adam7 emits fewer than 2 filter bytes per row on average.
+    const size_t raw = image.height * row_bytes + 2 * image.height + 8;
+    const size_t deflated = std::max(
+        128 + raw + raw / 10,
+        128 + raw + ((raw / (31 * 1024)) + 1) * 5
+    );
+    // chunk framing (8 KB IDATs), zlib header and trailer,
+    // signature, IHDR, IEND and sync flushes between strips.
+    return deflated + ((deflated / 8192) + 1) * 12 + 8 + 25 + 12 + 1024;
+}
+
+// Filter choice that picks one filter for the whole image from a
+// sample of rows (see choose_image_filter) instead of one per row.
+const int FILTER_CHOICE_FAST = 1 << 8;
+
+// How to filter and deflate an image. -1 leaves filter_choice and
+// strategy to libspng, which doesn't filter at compress_level 0 and
+// uses Z_FILTERED for filtered rows and Z_DEFAULT_STRATEGY otherwise.
+struct EncodeOptions {
+    int compress_level; // 0-9
+    int filter_choice; // spng_filter_choice flags or FILTER_CHOICE_FAST
+    int strategy; // Z_DEFAULT_STRATEGY, Z_FILTERED, Z_HUFFMAN_ONLY, Z_RLE or Z_FIXED
+    int window_bits; // 9-15, log2 of the LZ77 window size
+    int mem_level; // 1-9, memory used for deflate's match finder
+    bool reduce; // write indexed or low bit depth PNGs when lossless, see palette.hpp
+
+    EncodeOptions(
+        const int compress_level_ = 6,
+        const int filter_choice_ = -1,
+        const int strategy_ = -1,
+        const int window_bits_ = 15,
+        const int mem_level_ = 8,
+        const bool reduce_ = false
+    ) : compress_level(compress_level_), filter_choice(filter_choice_),
+        strategy(strategy_), window_bits(window_bits_), mem_level(mem_level_),
+        reduce(reduce_)
+    {}
+
+    void validate() const {
+        if (compress_level < 0 || compress_level > 9) {
+            throw std::invalid_argument("pyspng: compress_level must be between 0 and 9. Got: " + std::to_string(compress_level));
+        }
+        if (filter_choice != -1
+            && filter_choice != FILTER_CHOICE_FAST
+            && (filter_choice & ~SPNG_FILTER_CHOICE_ALL)
+        ) {
+            throw std::invalid_argument("pyspng: invalid filter choice: " + std::to_string(filter_choice));
+        }
+        if (strategy < -1 || strategy > Z_FIXED) {
+            throw std::invalid_argument("pyspng: invalid compression strategy: " + std::to_string(strategy));
+        }
+#ifdef SPNG_USE_MINIZ
+        if (window_bits != 15) {
+            throw std::invalid_argument("pyspng: window_bits must be 15 when built with miniz. Got: " + std::to_string(window_bits));
+        }
+#else
+        if (window_bits < 9 || window_bits > 15) {
+            throw std::invalid_argument("pyspng: window_bits must be between 9 and 15. Got: " + std::to_string(window_bits));
+        }
+#endif
+        if (mem_level < 1 || mem_level > 9) {
+            throw std::invalid_argument("pyspng: mem_level must be between 1 and 9. Got: " + std::to_string(mem_level));
+        }
+    }
+};
+
+// The spng_filter_choice flags to encode image with, or -1 for
+// libspng's default. FILTER_CHOICE_FAST becomes the single flag
+// of the filter it picks.
+inline int resolve_filter_choice(const ImageView &image, const EncodeOptions &options) {
+    if (options.filter_choice != FILTER_CHOICE_FAST) {
+        return options.filter_choice;
+    }
+    const int filter = choose_image_filter(
+        static_cast<const uint8_t*>(image.data),
+        image.height, image.row_bytes(), image.filter_bpp(), image.sample_bytes
+    );
+    return 1 << (filter + 3);
+}
+
+// Stores the PLTE, and tRNS if needed, of an indexed image.
+inline void set_palette(spng_ctx *ctx, const Palette &palette) {
+    struct spng_plte plte;
+    struct spng_trns trns;
+    memset(&plte, 0, sizeof(plte));
+    memset(&trns, 0, sizeof(trns));
+
+    plte.n_entries = static_cast<uint32_t>(palette.size);
+    for (size_t i = 0; i < palette.size; i++) {
+        plte.entries[i].red = palette.rgba[i][0];
+        plte.entries[i].green = palette.rgba[i][1];
+        plte.entries[i].blue = palette.rgba[i][2];
+        plte.entries[i].alpha = 255;
+
+        // tRNS may stop after the last entry that isn't opaque
+        if (palette.rgba[i][3] != 255) {
+            trns.n_type3_entries = static_cast<uint32_t>(i + 1);
+        }
+        trns.type3_alpha[i] = palette.rgba[i][3];
+    }
+
+    int error = spng_set_plte(ctx, &plte);
+    if (!error && trns.n_type3_entries > 0) {
+        error = spng_set_trns(ctx, &trns);
+    }
+    if (error) {
+        throw std::runtime_error("pyspng: " + std::string(spng_strerror(error)));
+    }
+}
+
+inline void encode_progressive_image(
+    const spng_ctx_ptr &ctx,
+    const ImageView &image,
+    const bool interlaced
+) {
+    int error = spng_encode_image(
+        ctx.get(), image.data, image.nbytes(),
+        SPNG_FMT_PNG, SPNG_ENCODE_PROGRESSIVE
+    );
+
+    if (error) {
+        throw std::runtime_error("pyspng: " + std::string(spng_strerror(error)));
+    }
+
+    const size_t height = image.height;
+    const size_t row_bytes = image.row_bytes();
+
+    struct spng_row_info row_info;
+    const uint8_t *imgptr = static_cast<const uint8_t*>(image.data);
+
+    if (interlaced) {
+        do {
+            error = spng_get_row_info(ctx.get(), &row_info);
+            if (error) {
+                break;
+            }
+
+            const uint8_t *row = imgptr + row_bytes * row_info.row_num;
+            error = spng_encode_row(ctx.get(), static_cast<const void *>(row), row_bytes);
+        } while (!error);
+    }
+    else {
+        for (size_t y = 0; y < height; y++) {
+            const uint8_t *row = imgptr + row_bytes * y;
+            error = spng_encode_row(ctx.get(), static_cast<const void *>(row), row_bytes);
+
+            if (error) {
+                break;
+            }
+        }
+    }
+
+    if (error == SPNG_EOI) {
+        error = spng_encode_chunks(ctx.get());
+    }
+
+    if (error) {
+        throw std::runtime_error("pyspng: " + std::string(spng_strerror(error)));
+    }
+}
+
+inline void encode(
+    const ImageView &image,
+    const int progressive,
+    const EncodeOptions &options,
+    ByteSink &sink,
+    CallStats *stats = NULL
+) {
+    if (progressive < 0 || progressive > 2) {
+        throw std::runtime_error("pyspng: Unsupported progressive mode option: " + std::to_string(progressive));
+    }
+    options.validate();
+
+    spng_ctx_ptr ctx = new_ctx(SPNG_CTX_ENCODER);
+
+    if (stats) {
+        stats->reserve_rows(image.width, image.height, progressive == PROGRESSIVE_MODE_INTERLACED);
+        stats->attach(ctx.get());
+    }
+
+    spng_set_png_stream(ctx.get(), png_sink_write_fn, &sink);
+    spng_set_option(ctx.get(), SPNG_IMG_COMPRESSION_LEVEL, options.compress_level);
+    spng_set_option(ctx.get(), SPNG_IMG_WINDOW_BITS, options.window_bits);
+    spng_set_option(ctx.get(), SPNG_IMG_MEM_LEVEL, options.mem_level);
+
+    // setting these would stop libspng from picking them
+    if (options.strategy >= 0) {
+        spng_set_option(ctx.get(), SPNG_IMG_COMPRESSION_STRATEGY, options.strategy);
+    }
+    int filter_choice;
+    {
+        ScopedTimer timer(stats ? &stats->spng.filter_ns : NULL);
+        filter_choice = resolve_filter_choice(image, options);
+    }
+    if (filter_choice >= 0) {
+        spng_set_option(ctx.get(), SPNG_FILTER_CHOICE, filter_choice);
+    }
+
+    const uint8_t bit_depth = static_cast<uint8_t>(image.bit_depth());
+    const uint8_t color_type = png_color_type(image);
+
+    uint8_t interlace_method = (progressive == PROGRESSIVE_MODE_INTERLACED)
+        ? SPNG_INTERLACE_ADAM7
+        : SPNG_INTERLACE_NONE;
+
+    struct spng_ihdr ihdr = {
+        static_cast<uint32_t>(image.width), // .width
+        static_cast<uint32_t>(image.height), // .height
+        bit_depth, // .bit_depth
+        color_type, // .color_type
+        0, // .compression_method
+        0, // .filter_method
+        static_cast<uint8_t>(interlace_method) // .interlace_method
+    };
+    spng_set_ihdr(ctx.get(), &ihdr);
+
+    if (image.palette) {
+        set_palette(ctx.get(), *image.palette);
+    }
+
+    try {
+        /* SPNG_FMT_PNG is a special value that matches the format in ihdr,
+           SPNG_ENCODE_FINALIZE will finalize the PNG with the end-of-file marker */
+        if (progressive == PROGRESSIVE_MODE_NONE) {
+            int error = spng_encode_image(ctx.get(), image.data, image.nbytes(), SPNG_FMT_PNG, SPNG_ENCODE_FINALIZE);
+            if (error) {
+                throw std::runtime_error("pyspng: " + std::string(spng_strerror(error)));
+            }
+        }
+        else {
+            encode_progressive_image(ctx, image, (progressive == PROGRESSIVE_MODE_INTERLACED));
+        }
+    }
+    catch (const std::runtime_error &) {
+        // report why the sink failed rather than a generic I/O error
+        if (sink.error) {
+            std::rethrow_exception(sink.error);
+        }
+        throw;
+    }
+}
+
+inline std::string encode(
+    const ImageView &image,
+    const int progressive = PROGRESSIVE_MODE_NONE,
+    const EncodeOptions &options = EncodeOptions()
+) {
+    PngSink sink;
+    encode(image, progressive, options, sink);
+    return sink.spill;
+}
+
+};
+
+#endif
@@ -0,0 +1,75 @@
+/*
+ * Reading and writing PNGs directly from and to files.
+ *
+ * libspng's stream API moves at most 8 KB per call, so decoding
+ * from and encoding to a file only ever holds a fixed size I/O
+ * buffer of compressed data instead of the whole PNG.
+ */
+
+#ifndef __PYSPNG_FILE_IO_HPP__
+#define __PYSPNG_FILE_IO_HPP__
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+#include "codec.hpp"
+
+namespace pyspng {
+
+// Size of the buffer between the file and libspng.
+const size_t IO_BUFFER_SIZE = 64 * 1024;
+
+typedef std::unique_ptr<FILE, int(*)(FILE*)> file_ptr;
+
+// A failed open, write or close of path, raised as OSError
+// (e.g. FileNotFoundError) with errno and filename in Python.
+class FileError : public std::runtime_error {
+public:
+    FileError(const std::string &action, const std::string &path_, const int errno_)
+        : std::runtime_error("pyspng: unable to " + action + " " + path_ + ": " + std::string(strerror(errno_))),
+          path(path_), error(errno_ ? errno_ : EIO) {}
+
+    std::string path;
+    int error;
+};
+
+inline file_ptr open_file(const std::string &path, const char *mode) {
+    file_ptr file(fopen(path.c_str(), mode), fclose);
+    if (!file) {
+        throw FileError("open", path, errno);
+    }
+    setvbuf(file.get(), NULL, _IOFBF, IO_BUFFER_SIZE);
+    return file;
+}
+
+class FileSink : public ByteSink {
+public:
+    FileSink(FILE *file_, const std::string &path_) : file(file_), path(path_) {}
+
+    void write(const void *src, size_t len) override {
+        if (fwrite(src, 1, len, file) != len) {
+            throw FileError("write", path, errno);
+        }
+    }
+
+private:
+    FILE *file;
+    std::string path;
+};
+
+// Flushes and closes the file, reporting errors
+// that only show up when buffered data hits the disk.
+inline void close_file(file_ptr &file, const std::string &path) {
+    FILE *raw = file.release();
+    if (fclose(raw) != 0) {
+        throw FileError("write", path, errno);
+    }
+}
+
+};
+
+#endif
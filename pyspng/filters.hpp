@@ -0,0 +1,117 @@
+/*
+ * PNG scanline filters for the encoder.
+ *
+ * The filters themselves are libspng's (SIMD where available),
+ * exported from our copy of spng.c, so that images encoded
+ * outside of libspng, e.g. by the parallel strip encoder, are
+ * filtered exactly the same way.
+ */
+
+#ifndef __PYSPNG_FILTERS_HPP__
+#define __PYSPNG_FILTERS_HPP__
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "spng.h"
+
+extern "C" {
+    unsigned spng__get_best_filter(
+        unsigned char *filtered, const unsigned char *prev_scanline, const unsigned char *scanline,
+        size_t scanline_width, unsigned bytes_per_pixel, int choices
+    );
+    uint64_t spng__filter_sum(const unsigned char *filtered, size_t size);
+    void spng__u16_row_to_bigendian(void *row, size_t size);
+}
+
+namespace pyspng {
+
+// Rows sampled by choose_image_filter.
+const size_t FILTER_SAMPLE_ROWS = 16;
+
+// PNG samples are stored big-endian.
+inline void copy_row_to_bigendian(uint8_t *dest, const uint8_t *src, const size_t nbytes, const size_t sample_bytes) {
+    memcpy(dest, src, nbytes);
+    if (sample_bytes == 2) {
+        spng__u16_row_to_bigendian(dest, nbytes);
+    }
+}
+
+// Filters row with the best filter of choices, a bitfield of
+// spng_filter_choice flags, by the minimum sum of absolute
+// differences heuristic and writes the filtered bytes into out.
+// prev is the unfiltered previous row (all zeros for the first
+// row of the image). Returns the filter type used.
+inline int filter_row(
+    uint8_t *out, const uint8_t *row, const uint8_t *prev,
+    const size_t rowbytes, const size_t bpp,
+    const int choices
+) {
+    const unsigned filter = spng__get_best_filter(
+        out, prev, row, rowbytes + 1, static_cast<unsigned>(bpp), choices
+    );
+    if (filter == SPNG_FILTER_NONE) {
+        memcpy(out, row, rowbytes);
+    }
+    return static_cast<int>(filter);
+}
+
+// Sum of the filtered bytes interpreted as signed values,
+// the usual PNG filter selection heuristic. scratch must
+// hold rowbytes bytes.
+inline uint64_t filter_cost(
+    const int filter, uint8_t *scratch,
+    const uint8_t *row, const uint8_t *prev,
+    const size_t rowbytes, const size_t bpp
+) {
+    filter_row(scratch, row, prev, rowbytes, bpp, 1 << (filter + 3));
+    return spng__filter_sum(scratch, rowbytes);
+}
+
+// Picks a single filter for a whole image from the total cost of
+// each filter over rows spread evenly through it. This is much
+// cheaper than trying every filter on every row and usually
+// compresses about as well on photographic and scientific data.
+inline int choose_image_filter(
+    const uint8_t *pixels,
+    const size_t height, const size_t rowbytes,
+    const size_t bpp, const size_t sample_bytes
+) {
+    const size_t samples = std::min(height, FILTER_SAMPLE_ROWS);
+
+    std::vector<uint8_t> row(rowbytes);
+    std::vector<uint8_t> prev(rowbytes);
+    std::vector<uint8_t> scratch(rowbytes);
+
+    uint64_t cost[5] = { 0, 0, 0, 0, 0 };
+    for (size_t s = 0; s < samples; s++) {
+        const size_t y = s * height / samples;
+
+        copy_row_to_bigendian(row.data(), pixels + y * rowbytes, rowbytes, sample_bytes);
+        if (y > 0) {
+            copy_row_to_bigendian(prev.data(), pixels + (y - 1) * rowbytes, rowbytes, sample_bytes);
+        }
+        else {
+            std::fill(prev.begin(), prev.end(), 0);
+        }
+
+        for (int filter = SPNG_FILTER_NONE; filter <= SPNG_FILTER_PAETH; filter++) {
+            cost[filter] += filter_cost(filter, scratch.data(), row.data(), prev.data(), rowbytes, bpp);
+        }
+    }
+
+    int best = SPNG_FILTER_NONE;
+    for (int filter = SPNG_FILTER_SUB; filter <= SPNG_FILTER_PAETH; filter++) {
+        if (cost[filter] < cost[best]) {
+            best = filter;
+        }
+    }
+    return best;
+}
+
+};
+
+#endif
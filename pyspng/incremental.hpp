@@ -0,0 +1,265 @@
+/*
+ * Push style decoding of a PNG that arrives in pieces.
+ *
+ * libspng pulls its input, so the decoder runs on a worker thread
+ * whose stream callback blocks until feed() has supplied enough
+ * bytes. Rows are decoded straight into the output image as soon
+ * as their compressed data is available, so by the time the last
+ * byte arrives there is little left to do.
+ */
+
+#ifndef __PYSPNG_INCREMENTAL_HPP__
+#define __PYSPNG_INCREMENTAL_HPP__
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+#include "codec.hpp"
+
+namespace pyspng {
+
+class IncrementalDecoder {
+public:
+    explicit IncrementalDecoder(const int fmt_)
+        : fmt(fmt_), data(NULL),
+          front_offset(0), buffered(0),
+          input_finished(false), cancelled(false),
+          has_header(false), rows(0), done(false)
+    {
+        worker = std::thread(&IncrementalDecoder::run, this);
+    }
+
+    ~IncrementalDecoder() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            cancelled = true;
+        }
+        input_ready.notify_all();
+        worker.join();
+        free(data);
+    }
+
+    // Appends the next piece of the PNG. The bytes are copied.
+    void feed(const void *bytes, const size_t len) {
+        if (len == 0) {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (input_finished) {
+                throw std::runtime_error("pyspng: cannot feed data after finish().");
+            }
+            // nothing will read it anymore
+            if (done) {
+                if (!error.empty()) {
+                    throw std::runtime_error(error);
+                }
+                return;
+            }
+            chunks.push_back(std::string(static_cast<const char*>(bytes), len));
+            buffered += len;
+        }
+        input_ready.notify_all();
+    }
+
+    // Marks the end of the input and waits for decoding to complete.
+    // Returns the image buffer, which stays owned by the decoder.
+    void* finish() {
+        std::unique_lock<std::mutex> lock(mutex);
+        input_finished = true;
+        input_ready.notify_all();
+        progress.wait(lock, [this]() { return done; });
+
+        if (!error.empty()) {
+            throw std::runtime_error(error);
+        }
+        return data;
+    }
+
+    // Whether the IHDR has been parsed yet. Once it has,
+    // header() and the image layout are fixed.
+    bool header_ready() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return has_header;
+    }
+
+    const spng_ihdr &header() const {
+        return ihdr;
+    }
+
+    size_t channels() const {
+        return nc;
+    }
+
+    size_t sample_bytes() const {
+        return cs;
+    }
+
+    // The image being decoded, valid after header_ready(). Rows
+    // below rows_complete() are final, the rest are still changing.
+    void* image() const {
+        return data;
+    }
+
+    // Number of leading rows of the image that are fully decoded.
+    size_t rows_complete() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return rows;
+    }
+
+    bool finished() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return done;
+    }
+
+private:
+    IncrementalDecoder(const IncrementalDecoder &) = delete;
+    IncrementalDecoder &operator=(const IncrementalDecoder &) = delete;
+
+    static int read_fn(spng_ctx *ctx, void *user, void *dest, size_t length) {
+        (void)ctx;
+        return static_cast<IncrementalDecoder*>(user)->read(static_cast<char*>(dest), length);
+    }
+
+    int read(char *dest, size_t length) {
+        std::unique_lock<std::mutex> lock(mutex);
+        input_ready.wait(lock, [&]() {
+            return cancelled || input_finished || buffered >= length;
+        });
+
+        if (cancelled) {
+            return SPNG_IO_ERROR;
+        }
+        if (buffered < length) {
+            return SPNG_IO_EOF;
+        }
+
+        buffered -= length;
+        while (length > 0) {
+            const std::string &front = chunks.front();
+            const size_t n = std::min(length, front.size() - front_offset);
+            memcpy(dest, front.data() + front_offset, n);
+            dest += n;
+            length -= n;
+            front_offset += n;
+            if (front_offset == front.size()) {
+                chunks.pop_front();
+                front_offset = 0;
+            }
+        }
+        return 0;
+    }
+
+    void set_rows(const size_t n) {
+        std::lock_guard<std::mutex> lock(mutex);
+        rows = n;
+    }
+
+    void decode() {
+        DecodePlan plan = plan_decode(read_fn, this, fmt);
+
+        nc = plan.channels;
+        cs = plan.sample_bytes;
+        ihdr = plan.ihdr;
+
+        // zeroed so rows that aren't decoded yet read as black
+        data = calloc(plan.out_size, 1);
+        if (data == NULL) {
+            throw std::runtime_error("pyspng: unable to allocate " + std::to_string(plan.out_size) + " bytes.");
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            has_header = true;
+        }
+
+        spng_ctx *ctx = plan.ctx.get();
+        int res;
+        if ((res = spng_decode_image(ctx, NULL, 0, plan.render_fmt, plan.decode_flags | SPNG_DECODE_PROGRESSIVE)) != SPNG_OK) {
+            throw std::runtime_error("pyspng: could not decode image: " + std::string(spng_strerror(res)));
+        }
+
+        const size_t row_bytes = plan.row_bytes();
+        uint8_t *pixels = static_cast<uint8_t*>(data);
+        const size_t height = ihdr.height;
+
+        // Row info describes the row the next call will decode. Adam7
+        // pass 5 completes the even rows and pass 6 the odd ones, so
+        // rows only become final during the last pass.
+        struct spng_row_info row_info;
+        do {
+            if ((res = spng_get_row_info(ctx, &row_info)) != SPNG_OK) {
+                break;
+            }
+
+            res = spng_decode_row(ctx, pixels + row_info.row_num * row_bytes, row_bytes);
+            if (res != SPNG_OK && res != SPNG_EOI) {
+                break;
+            }
+
+            if (ihdr.interlace_method == SPNG_INTERLACE_NONE) {
+                set_rows(row_info.row_num + 1);
+            }
+            else if (row_info.pass == 6) {
+                set_rows(std::min(static_cast<size_t>(row_info.row_num) + 2, height));
+            }
+        } while (res == SPNG_OK);
+
+        if (res != SPNG_EOI) {
+            throw std::runtime_error("pyspng: could not decode image: " + std::string(spng_strerror(res)));
+        }
+        set_rows(height);
+    }
+
+    void run() {
+        std::string message;
+        try {
+            decode();
+        }
+        catch (const std::exception &e) {
+            message = e.what();
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            error = message;
+            done = true;
+        }
+        progress.notify_all();
+    }
+
+    const int fmt;
+
+    // written by the worker before has_header is set
+    spng_ihdr ihdr;
+    size_t nc;
+    size_t cs;
+    void *data;
+
+    mutable std::mutex mutex;
+    std::condition_variable input_ready;
+    std::condition_variable progress;
+
+    std::deque<std::string> chunks;
+    size_t front_offset;
+    size_t buffered;
+    bool input_finished;
+    bool cancelled;
+
+    bool has_header;
+    size_t rows;
+    bool done;
+    std::string error;
+
+    std::thread worker;
+};
+
+};
+
+#endif
@@ -1,177 +1,528 @@
 #include <pybind11/pybind11.h>
 #include <pybind11/numpy.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <functional>
+#include <memory>
 #include <string>
 #include <cstdint>
+#include <cstring>
+#include <exception>
+#include <vector>
 
 #include "spng.h"
+#include "codec.hpp"
+#include "file_io.hpp"
+#include "incremental.hpp"
+#include "palette.hpp"
+#include "parallel.hpp"
+#include "preview.hpp"
+#include "stats.hpp"
+#include "strip_encoder.hpp"
 
 namespace py = pybind11;
 
 #define STRINGIFY(x) #x
 #define MACRO_STRINGIFY(x) STRINGIFY(x)
 
-enum ProgressiveMode {
-    PROGRESSIVE_MODE_NONE = 0,
-    PROGRESSIVE_MODE_PROGRESSIVE = 1,
-    PROGRESSIVE_MODE_INTERLACED = 2
+using pyspng::CallStats;
+using pyspng::DecodedImage;
+using pyspng::EncodeOptions;
+using pyspng::ImageView;
+using pyspng::ScopedTimer;
+
+// Read-only view of any C-contiguous buffer protocol object
+// (bytes, bytearray, memoryview, mmap, numpy arrays, ...)
+// so PNG data can be decoded in place without copying it.
+class InputBuffer {
+public:
+    explicit InputBuffer(const py::handle &obj) : valid(false) {
+        if (PyObject_GetBuffer(obj.ptr(), &view, PyBUF_SIMPLE) != 0) {
+            throw py::error_already_set();
+        }
+        valid = true;
+    }
+
+    InputBuffer(InputBuffer &&other) : view(other.view), valid(other.valid) {
+        other.valid = false;
+    }
+
+    ~InputBuffer() {
+        if (valid) {
+            PyBuffer_Release(&view);
+        }
+    }
+
+    const void *data() const {
+        return view.buf;
+    }
+
+    size_t size() const {
+        return static_cast<size_t>(view.len);
+    }
+
+private:
+    InputBuffer(const InputBuffer &) = delete;
+    InputBuffer &operator=(const InputBuffer &) = delete;
+
+    Py_buffer view;
+    bool valid;
 };
 
-template <typename T>
-void encode_progressive_image(
-    const std::unique_ptr<spng_ctx, void(*)(spng_ctx*)> &ctx,
-    const py::array &image,
-    const bool interlaced
-) {
-    spng_encode_image(
-        ctx.get(), image.data(), image.nbytes(), 
-        SPNG_FMT_PNG, SPNG_ENCODE_PROGRESSIVE
-    );
+// A bytes object preallocated to the worst case encoded size. The
+// encoder writes straight into it and it is shrunk to fit afterwards,
+// so the PNG is never copied.
+class OutputBytes {
+public:
+    explicit OutputBytes(const size_t capacity) {
+        obj = PyBytes_FromStringAndSize(NULL, static_cast<py::ssize_t>(capacity));
+        if (obj == NULL) {
+            throw py::error_already_set();
+        }
+        sink = pyspng::PngSink(PyBytes_AS_STRING(obj), capacity);
+    }
 
-    int error;
-    size_t width = image.shape(1);
-    size_t height = image.shape(0);
-    size_t num_channels = 1;
+    OutputBytes(OutputBytes &&other) : sink(std::move(other.sink)), obj(other.obj) {
+        other.obj = NULL;
+    }
 
-    if (image.ndim() > 2) {
-        num_channels = image.shape(2);
+    ~OutputBytes() {
+        Py_XDECREF(obj);
     }
 
-    struct spng_row_info row_info;
-    const T* imgptr = static_cast<const T*>(image.data());
+    // Requires the GIL.
+    py::bytes finish() {
+        PyObject *result = NULL;
 
-    if (interlaced) {
-        do {
-            error = spng_get_row_info(ctx.get(), &row_info);
-            if (error) {
-                break;
+        if (sink.spill.empty()) {
+            result = obj;
+            obj = NULL;
+            if (_PyBytes_Resize(&result, static_cast<py::ssize_t>(sink.size)) != 0) {
+                throw py::error_already_set();
+            }
+        }
+        else {
+            // the worst case estimate was exceeded, stitch the pieces together
+            result = PyBytes_FromStringAndSize(NULL, static_cast<py::ssize_t>(sink.total()));
+            if (result == NULL) {
+                throw py::error_already_set();
             }
+            memcpy(PyBytes_AS_STRING(result), sink.buf, sink.size);
+            memcpy(PyBytes_AS_STRING(result) + sink.size, sink.spill.data(), sink.spill.size());
+        }
 
-            const T *row = imgptr + width * num_channels * row_info.row_num;
-            error = spng_encode_row(
-                ctx.get(), 
-                static_cast<const void *>(row), 
-                width * num_channels * sizeof(T)
-            );
-        } while (!error);
+        return py::reinterpret_steal<py::bytes>(result);
     }
-    else {
-        for (size_t y = 0; y < height; y++) {
-            const T *row = imgptr + width * num_channels * y;
-            error = spng_encode_row(
-                ctx.get(), 
-                static_cast<const void *>(row), 
-                width * num_channels * sizeof(T)
-            );
 
-            if (error) { 
-                break;
-            }
+    pyspng::PngSink sink;
+
+private:
+    OutputBytes(const OutputBytes &) = delete;
+    OutputBytes &operator=(const OutputBytes &) = delete;
+
+    PyObject *obj;
+};
+
+// Holds a Python exception raised inside a libspng callback
+// until the GIL is back and it can be rethrown.
+class PendingError {
+public:
+    PendingError() : type(NULL), value(NULL), trace(NULL) {}
+
+    ~PendingError() {
+        Py_XDECREF(type);
+        Py_XDECREF(value);
+        Py_XDECREF(trace);
+    }
+
+    // Requires the GIL.
+    void capture(py::error_already_set &err) {
+        err.restore();
+        PyErr_Fetch(&type, &value, &trace);
+    }
+
+    bool pending() const {
+        return type != NULL;
+    }
+
+    // Requires the GIL.
+    void rethrow_if_pending() {
+        if (type != NULL) {
+            PyErr_Restore(type, value, trace);
+            type = value = trace = NULL;
+            throw py::error_already_set();
         }
     }
 
-    if (error == SPNG_EOI) {
-        spng_encode_chunks(ctx.get());
+private:
+    PendingError(const PendingError &) = delete;
+    PendingError &operator=(const PendingError &) = delete;
+
+    PyObject *type;
+    PyObject *value;
+    PyObject *trace;
+};
+
+// Feeds a Python file-like object to libspng's stream API. The GIL
+// is only taken to refill a fixed size buffer with file.read().
+class PyFileReader {
+public:
+    explicit PyFileReader(const py::object &file_)
+        : file(file_), buffer(pyspng::IO_BUFFER_SIZE), pos(0), end(0) {}
+
+    static int read_fn(spng_ctx *ctx, void *user, void *dest, size_t length) {
+        (void)ctx;
+        return static_cast<PyFileReader*>(user)->read(static_cast<uint8_t*>(dest), length);
     }
-    else {
-        std::string errstr(spng_strerror(error));
-        throw new std::runtime_error(errstr);
+
+    PendingError py_error;
+
+private:
+    int read(uint8_t *dest, size_t length) {
+        while (length > 0) {
+            if (pos == end && !fill()) {
+                return py_error.pending() ? SPNG_IO_ERROR : SPNG_IO_EOF;
+            }
+            const size_t n = std::min(length, end - pos);
+            memcpy(dest, buffer.data() + pos, n);
+            dest += n;
+            length -= n;
+            pos += n;
+        }
+        return 0;
     }
-}
 
-py::bytes encode_image(
-    const py::array &image, 
-    const int progressive = PROGRESSIVE_MODE_NONE,
-    const int compress_level = 6
-) {
-    if (progressive < 0 || progressive > 2) {
-        throw new std::runtime_error("pyspng: Unsupported progressive mode option: " + std::to_string(progressive));
+    bool fill() {
+        py::gil_scoped_acquire acquire;
+        try {
+            py::object chunk = file.attr("read")(buffer.size());
+            InputBuffer bytes(chunk);
+            if (bytes.size() > buffer.size()) {
+                buffer.resize(bytes.size());
+            }
+            memcpy(buffer.data(), bytes.data(), bytes.size());
+            pos = 0;
+            end = bytes.size();
+        }
+        catch (py::error_already_set &err) {
+            py_error.capture(err);
+            return false;
+        }
+        return end > 0;
     }
 
-    std::unique_ptr<spng_ctx, void(*)(spng_ctx*)> ctx(spng_ctx_new(SPNG_CTX_ENCODER), spng_ctx_free);
+    py::object file;
+    std::vector<uint8_t> buffer;
+    size_t pos;
+    size_t end;
+};
 
-    spng_set_option(ctx.get(), SPNG_ENCODE_TO_BUFFER, 1);
-    spng_set_option(ctx.get(), SPNG_IMG_COMPRESSION_LEVEL, compress_level);
+// Collects encoder output in a fixed size buffer and passes
+// it to file.write() whenever it fills up.
+class PyFileSink : public pyspng::ByteSink {
+public:
+    explicit PyFileSink(const py::object &file_)
+        : file(file_), buffer(pyspng::IO_BUFFER_SIZE), size(0),
+          raw(py::isinstance(file_, py::module::import("io").attr("RawIOBase"))) {}
 
-    uint8_t bit_depth = image.dtype().itemsize() * 8;
-    uint8_t color_type = SPNG_COLOR_TYPE_GRAYSCALE;
+    void write(const void *src, size_t len) override {
+        const uint8_t *bytes = static_cast<const uint8_t*>(src);
+        while (len > 0) {
+            const size_t n = std::min(len, buffer.size() - size);
+            memcpy(buffer.data() + size, bytes, n);
+            size += n;
+            bytes += n;
+            len -= n;
+            if (size == buffer.size()) {
+                flush();
+            }
+        }
+    }
 
-    if (image.ndim() == 3) {
-        switch (image.shape(2)) {
-            case 1: color_type = SPNG_COLOR_TYPE_GRAYSCALE; break;
-            case 2: color_type = SPNG_COLOR_TYPE_GRAYSCALE_ALPHA; break;
-            case 3: color_type = SPNG_COLOR_TYPE_TRUECOLOR; break;
-            case 4: color_type = SPNG_COLOR_TYPE_TRUECOLOR_ALPHA; break;
-            default: throw new std::runtime_error("pyspng: Too many channels in image.");
+    void flush() {
+        if (size == 0) {
+            return;
         }
-    } 
-
-    uint8_t interlace_method = (progressive == PROGRESSIVE_MODE_INTERLACED)
-        ? SPNG_INTERLACE_ADAM7 
-        : SPNG_INTERLACE_NONE;
-
-    struct spng_ihdr ihdr = {
-        static_cast<uint32_t>(image.shape(1)), // .width
-        static_cast<uint32_t>(image.shape(0)), // .height
-        bit_depth, // .bit_depth
-        color_type, // .color_type
-        0, // .compression_method
-        0, // .filter_method
-        static_cast<uint8_t>(interlace_method) // .interlace_method
-    };
-    spng_set_ihdr(ctx.get(), &ihdr);
-
-    /* SPNG_FMT_PNG is a special value that matches the format in ihdr,
-       SPNG_ENCODE_FINALIZE will finalize the PNG with the end-of-file marker */
-    if (progressive == PROGRESSIVE_MODE_NONE) {
-        spng_encode_image(ctx.get(), image.data(), image.nbytes(), SPNG_FMT_PNG, SPNG_ENCODE_FINALIZE);
-    }
-    else if (progressive == PROGRESSIVE_MODE_PROGRESSIVE || progressive == PROGRESSIVE_MODE_INTERLACED) {
-        if (bit_depth == 16) {
-            encode_progressive_image<uint16_t>(ctx, image, (progressive == PROGRESSIVE_MODE_INTERLACED));    
+
+        py::gil_scoped_acquire acquire;
+        try {
+            size_t written = 0;
+            while (written < size) {
+                py::object ret = file.attr("write")(
+                    py::bytes(reinterpret_cast<const char*>(buffer.data() + written), size - written)
+                );
+                // Raw (unbuffered) files may write only part of it and
+                // return None if they would block. Other objects may
+                // return None once all of it is written.
+                if (ret.is_none() && !raw) {
+                    break;
+                }
+                const size_t n = ret.is_none() ? 0 : ret.cast<size_t>();
+                if (n == 0) {
+                    if (ret.is_none()) {
+                        errno = EAGAIN; // BlockingIOError
+                        PyErr_SetFromErrno(PyExc_OSError);
+                    }
+                    else {
+                        PyErr_SetString(PyExc_OSError, "pyspng: file.write() wrote no bytes.");
+                    }
+                    throw py::error_already_set();
+                }
+                written += n;
+            }
         }
-        else {
-            encode_progressive_image<uint8_t>(ctx, image, (progressive == PROGRESSIVE_MODE_INTERLACED));
+        catch (py::error_already_set &err) {
+            py_error.capture(err);
+            throw std::runtime_error("pyspng: unable to write to file object.");
         }
+        size = 0;
     }
-    else {
-        throw new std::runtime_error("This should never happen.");
-    }
-
-    size_t png_size = 0;
-    int error = 0;
-    /* PNG is written to an internal buffer by default */
-    // std::unique_ptr<unsigned char *> pngbuffer;
-    // pngbuffer = std::move(static_cast<unsigned char*>(
-    //     spng_get_png_buffer(ctx.get(), &png_size, &error)
-    // ));
-    char *pngbuffer = static_cast<char*>(
-        spng_get_png_buffer(ctx.get(), &png_size, &error)
+
+    PendingError py_error;
+
+private:
+    py::object file;
+    std::vector<uint8_t> buffer;
+    size_t size;
+    bool raw;
+};
+
+ImageView image_view(const py::array &image) {
+    ImageView view;
+    view.data = image.data();
+    view.height = image.shape(0);
+    view.width = image.shape(1);
+    view.channels = (image.ndim() > 2) ? image.shape(2) : 1;
+    view.sample_bytes = image.dtype().itemsize();
+    view.packed_bits = 0;
+    view.palette = NULL;
+    return view;
+}
+
+py::array to_numpy(const DecodedImage &image) {
+    py::capsule free_when_done(image.data, [](void *f) {
+        free(f);
+    });
+
+    const py::ssize_t h = image.height;
+    const py::ssize_t w = image.width;
+    const py::ssize_t nc = image.channels;
+    const py::ssize_t cs = image.sample_bytes;
+
+    return py::array(
+        cs == 1 ? py::dtype("uint8") : py::dtype("uint16"),
+        {h, w, nc},              // shape
+        {w*nc*cs, nc*cs, cs},    // index strides in bytes
+        (uint8_t*)image.data,    // the data pointer
+        free_when_done           // numpy array references this parent
     );
+}
+
+// The stats=True dict. Decoders inflate and unfilter,
+// encoders filter and deflate.
+py::dict stats_dict(CallStats &stats, const bool decoding, const uint64_t total_ns) {
+    stats.finish();
+
+    const char *filter_names[5] = { "none", "sub", "up", "avg", "paeth" };
+    py::dict filters;
+    for (int i = 0; i < 5; i++) {
+        filters[filter_names[i]] = stats.spng.filter_counts[i];
+    }
+
+    py::array_t<uint8_t> row_filters(static_cast<py::ssize_t>(stats.row_filters.size()));
+    if (!stats.row_filters.empty()) {
+        memcpy(row_filters.mutable_data(), stats.row_filters.data(), stats.row_filters.size());
+    }
+
+    py::dict d;
+    d["total_ns"] = total_ns;
+    d["input_ns"] = stats.input_ns;
+    if (decoding) {
+        d["header_ns"] = stats.header_ns;
+    }
+    d["chunks_ns"] = stats.spng.chunks_ns;
+    d[decoding ? "inflate_ns" : "deflate_ns"] = stats.spng.zlib_ns;
+    d[decoding ? "unfilter_ns" : "filter_ns"] = stats.spng.filter_ns;
+    d["convert_ns"] = stats.convert_ns();
+    d["alloc_ns"] = stats.alloc_ns;
+    d["input_bytes"] = stats.input_bytes;
+    d["idat_bytes"] = stats.spng.idat_bytes;
+    d[decoding ? "inflated_bytes" : "deflated_bytes"] = stats.spng.scanline_bytes;
+    d["output_bytes"] = stats.output_bytes;
+    d["scanlines"] = stats.spng.scanlines;
+    d["filters"] = filters;
+    d["row_filters"] = row_filters;
+    return d;
+}
+
+// Call without the GIL. stats, if not NULL, is filled in.
+void encode_to(
+    const ImageView &view,
+    const int progressive,
+    const EncodeOptions &options,
+    const size_t threads,
+    pyspng::ByteSink &sink,
+    CallStats *stats = NULL
+) {
+    ScopedTimer timer(stats ? &stats->codec_ns : NULL);
+
+    pyspng::ReducedImage reduced;
+    const ImageView &image = (options.reduce && pyspng::reduce_image(view, reduced))
+        ? reduced.view
+        : view;
+
+    if (
+        progressive != pyspng::PROGRESSIVE_MODE_INTERLACED
+        && pyspng::num_strips(image, threads) > 1
+    ) {
+        pyspng::encode_strips(image, options, threads, sink, stats);
+    }
+    else {
+        pyspng::encode(image, progressive, options, sink, stats);
+    }
+}
+
+// Returns the PNG, or (PNG, stats dict) if with_stats.
+py::object encode_image(
+    const py::array &image,
+    const int progressive = pyspng::PROGRESSIVE_MODE_NONE,
+    const EncodeOptions &options = EncodeOptions(),
+    const size_t threads = 1,
+    const bool with_stats = false
+) {
+    const uint64_t start = with_stats ? pyspng::clock_ns() : 0;
+    CallStats stats;
+    CallStats *s = with_stats ? &stats : NULL;
+
+    ImageView view = image_view(image);
+
+    std::unique_ptr<OutputBytes> out;
+    {
+        ScopedTimer timer(s ? &s->alloc_ns : NULL);
+        out.reset(new OutputBytes(pyspng::max_encoded_size(view)));
+    }
+    {
+        py::gil_scoped_release release;
+        encode_to(view, progressive, options, threads, out->sink, s);
+    }
+
+    py::bytes png;
+    {
+        ScopedTimer timer(s ? &s->alloc_ns : NULL);
+        png = out->finish();
+    }
+    if (!with_stats) {
+        return png;
+    }
+
+    stats.input_bytes = view.nbytes();
+    stats.output_bytes = out->sink.total();
+    return py::make_tuple(png, stats_dict(stats, false, pyspng::clock_ns() - start));
+}
+
+void encode_file(
+    const std::string &path,
+    const py::array &image,
+    const int progressive,
+    const EncodeOptions &options,
+    const size_t threads
+) {
+    ImageView view = image_view(image);
 
-    if (error) {
-        free(pngbuffer);
-        std::string errstr(spng_strerror(error));
-        throw new std::runtime_error(errstr);
+    py::gil_scoped_release release;
+    pyspng::file_ptr file = pyspng::open_file(path, "wb");
+    try {
+        pyspng::FileSink sink(file.get(), path);
+        encode_to(view, progressive, options, threads, sink);
+        pyspng::close_file(file, path);
     }
+    catch (...) {
+        // don't leave a truncated PNG behind
+        file.reset();
+        remove(path.c_str());
+        throw;
+    }
+}
 
-    std::string outbytes(pngbuffer, png_size);
-    free(pngbuffer);
-    return py::bytes(outbytes);
+void encode_stream(
+    const py::object &fileobj,
+    const py::array &image,
+    const int progressive,
+    const EncodeOptions &options,
+    const size_t threads
+) {
+    ImageView view = image_view(image);
+    PyFileSink sink(fileobj);
+    try {
+        {
+            py::gil_scoped_release release;
+            encode_to(view, progressive, options, threads, sink);
+        }
+        sink.flush();
+    }
+    catch (const std::exception &) {
+        sink.py_error.rethrow_if_pending();
+        throw;
+    }
 }
 
-py::dict read_header(py::bytes png_bits) {
-    std::unique_ptr<spng_ctx, void(*)(spng_ctx*)> ctx(spng_ctx_new(0),  spng_ctx_free);
+py::tuple encode_many(
+    const py::list &images,
+    const int progressive,
+    const EncodeOptions &options,
+    const size_t threads
+) {
+    // once here instead of once per image under the workers
+    options.validate();
+
+    const size_t n = images.size();
 
-    // Set source PNG
-    std::string bits = png_bits;
-    spng_set_png_buffer(ctx.get(), bits.data(), bits.length());
+    std::vector<py::array> arrays;
+    std::vector<ImageView> views;
+    std::vector<OutputBytes> binaries;
+    arrays.reserve(n);
+    views.reserve(n);
+    binaries.reserve(n);
+    for (size_t i = 0; i < n; i++) {
+        arrays.push_back(images[i].cast<py::array>());
+        views.push_back(image_view(arrays.back()));
+        binaries.push_back(OutputBytes(pyspng::max_encoded_size(views.back())));
+    }
+
+    std::vector<std::string> errors(n);
+    std::vector<uint8_t> failed(n, 0);
 
-    struct spng_ihdr ihdr;
-    int res;
-    if ((res = spng_get_ihdr(ctx.get(), &ihdr)) != SPNG_OK) {
-        throw std::runtime_error("pyspng: could not decode ihdr: " + std::string(spng_strerror(res)));
+    {
+        py::gil_scoped_release release;
+        pyspng::parallel_for(n, threads, [&](const size_t i) {
+            try {
+                encode_to(views[i], progressive, options, 1, binaries[i].sink);
+            }
+            catch (const std::exception &e) {
+                errors[i] = e.what();
+                failed[i] = 1;
+            }
+        });
+    }
+
+    py::list results(n);
+    py::list messages(n);
+    for (size_t i = 0; i < n; i++) {
+        if (failed[i]) {
+            results[i] = py::none();
+            messages[i] = py::str(errors[i]);
+        }
+        else {
+            results[i] = binaries[i].finish();
+            messages[i] = py::none();
+        }
     }
 
+    return py::make_tuple(results, messages);
+}
+
+py::dict header_dict(const struct spng_ihdr &ihdr) {
     py::dict header;
     header["width"] = ihdr.width;
     header["height"] = ihdr.height;
@@ -180,101 +531,319 @@ py::dict read_header(py::bytes png_bits) {
     header["compression_method"] = ihdr.compression_method;
     header["filter_method"] = ihdr.filter_method;
     header["interlace_method"] = ihdr.interlace_method;
-    
+
     return header;
 }
 
-py::array decode_image_bytes(py::bytes png_bits, spng_format fmt) {
-    std::unique_ptr<spng_ctx, void(*)(spng_ctx*)> ctx(spng_ctx_new(0),  spng_ctx_free);
-
-    // Ignore and don't calculate chunk CRC's
-    spng_set_crc_action(ctx.get(), SPNG_CRC_USE, SPNG_CRC_USE);
-
-    // Set memory usage limits for storing standard and unknown chunks,
-    // this is important when reading arbitrary files!
-    size_t limit = 1024 * 1024 * 64;
-    spng_set_chunk_limits(ctx.get(), limit, limit);
-
-    // Set source PNG
-    std::string bits = png_bits;
-    spng_set_png_buffer(ctx.get(), bits.data(), bits.length());
-
-    struct spng_ihdr ihdr;
-    int res;
-    if ((res = spng_get_ihdr(ctx.get(), &ihdr)) != SPNG_OK) {
-        throw std::runtime_error("pyspng: could not decode ihdr: " + std::string(spng_strerror(res)));
-    }
-
-    // Decide spng_format based on ihdr.
-    //
-    // Note: this is most likely buggy/incomplete for 16-bit formats.
-    spng_format render_fmt = fmt;
-    if (fmt == 0) {
-        switch (ihdr.color_type) {
-            case SPNG_COLOR_TYPE_GRAYSCALE:
-                // TODO no G16 output format? using alpha
-                render_fmt = ihdr.bit_depth <= 8 ? SPNG_FMT_G8 : SPNG_FMT_GA16;
-                break;
-            case SPNG_COLOR_TYPE_TRUECOLOR:
-                // TODO no RGB16 output format? using alpha
-                render_fmt = ihdr.bit_depth <= 8 ? SPNG_FMT_RGB8 : SPNG_FMT_RGBA16;
-                break;
-            case SPNG_COLOR_TYPE_INDEXED:
-                render_fmt = SPNG_FMT_RGB8;
-                break;
-            case SPNG_COLOR_TYPE_GRAYSCALE_ALPHA:
-                render_fmt = ihdr.bit_depth <= 8 ? SPNG_FMT_GA8 : SPNG_FMT_GA16;
-                break;
-            case SPNG_COLOR_TYPE_TRUECOLOR_ALPHA:
-                render_fmt = ihdr.bit_depth <= 8 ? SPNG_FMT_RGBA8 : SPNG_FMT_RGBA16;
-                break;
+py::dict read_header(const py::object &png_bits) {
+    InputBuffer bits(png_bits);
+    struct spng_ihdr ihdr = pyspng::read_ihdr(bits.data(), bits.size());
+    return header_dict(ihdr);
+}
+
+// A view of the decoder's image that keeps the decoder alive.
+py::array incremental_image(const py::object &self) {
+    pyspng::IncrementalDecoder &decoder = self.cast<pyspng::IncrementalDecoder&>();
+
+    const py::ssize_t h = decoder.header().height;
+    const py::ssize_t w = decoder.header().width;
+    const py::ssize_t nc = decoder.channels();
+    const py::ssize_t cs = decoder.sample_bytes();
+
+    return py::array(
+        cs == 1 ? py::dtype("uint8") : py::dtype("uint16"),
+        {h, w, nc},
+        {w*nc*cs, nc*cs, cs},
+        static_cast<uint8_t*>(decoder.image()),
+        self
+    );
+}
+
+// region is None or a (y0, y1, x0, x1) tuple.
+bool parse_region(const py::object &obj, pyspng::Region &region) {
+    if (obj.is_none()) {
+        return false;
+    }
+    py::tuple bounds = obj.cast<py::tuple>();
+    if (bounds.size() != 4) {
+        throw py::value_error("pyspng: region must be (y0, y1, x0, x1).");
+    }
+    region.y0 = bounds[0].cast<size_t>();
+    region.y1 = bounds[1].cast<size_t>();
+    region.x0 = bounds[2].cast<size_t>();
+    region.x1 = bounds[3].cast<size_t>();
+    return true;
+}
+
+// Reads the header with open_plan and, if stats isn't
+// NULL, attaches them to the decoder.
+pyspng::DecodePlan open_instrumented(
+    const std::function<pyspng::DecodePlan()> &open_plan,
+    CallStats *stats
+) {
+    if (stats == NULL) {
+        return open_plan();
+    }
+
+    pyspng::DecodePlan plan;
+    {
+        ScopedTimer timer(&stats->header_ns);
+        plan = open_plan();
+    }
+    stats->reserve_rows(
+        plan.ihdr.width, plan.ihdr.height,
+        plan.ihdr.interlace_method != SPNG_INTERLACE_NONE
+    );
+    stats->attach(plan.ctx.get());
+    return plan;
+}
+
+// Decodes the image open_plan opens, either into out or into a new
+// array, with the GIL released. out and region may be None.
+// max_pass = 0 decodes all Adam7 passes. stats, if not NULL, is
+// filled in.
+py::array decode_planned(
+    const std::function<pyspng::DecodePlan()> &open_plan,
+    const py::object &out_obj, const py::object &region_obj,
+    const int max_pass = 0, const bool nearest_fill = false,
+    CallStats *stats = NULL
+) {
+    pyspng::Region region;
+    const bool has_region = parse_region(region_obj, region);
+
+    if (max_pass != 0 && (has_region || !out_obj.is_none())) {
+        throw py::value_error("pyspng: max_pass cannot be combined with out or region.");
+    }
+
+    if (out_obj.is_none()) {
+        DecodedImage image;
+        {
+            py::gil_scoped_release release;
+            pyspng::DecodePlan plan = open_instrumented(open_plan, stats);
+
+            ScopedTimer timer(stats ? &stats->codec_ns : NULL);
+            if (max_pass != 0) {
+                image = pyspng::decode_preview(plan, max_pass, nearest_fill);
+            }
+            else if (has_region) {
+                image = pyspng::decode_region(plan, region);
+            }
+            else {
+                image = pyspng::decode(plan);
+            }
         }
+
+        ScopedTimer timer(stats ? &stats->alloc_ns : NULL);
+        if (stats) {
+            stats->output_bytes = image.height * image.width * image.channels * image.sample_bytes;
+        }
+        return to_numpy(image);
     }
 
-    int nc; // num columns
-    int cs; // channel stride
-    switch (render_fmt) {
-        case SPNG_FMT_RGBA8:    nc = 4; cs = 1; break;
-        case SPNG_FMT_RGBA16:   nc = 4; cs = 2; break;
-        case SPNG_FMT_RGB8:     nc = 3; cs = 1; break;
-        case SPNG_FMT_GA8:      nc = 2; cs = 1; break;
-        case SPNG_FMT_GA16:     nc = 2; cs = 2; break;
-        case SPNG_FMT_G8:       nc = 1; cs = 1; break;
-        //case SPNG_FMT_G16:      nc = 1; cs = 2; break;
-        default:
-            throw std::runtime_error("pyspng: invalid output fmt");
+    // casting anything else would decode into a temporary copy
+    if (!py::isinstance<py::array>(out_obj)) {
+        throw py::type_error("pyspng: out must be a numpy array.");
     }
-    int w = ihdr.width;
-    int h = ihdr.height;
-    size_t out_size; 
+    py::array out = py::reinterpret_borrow<py::array>(out_obj);
 
-    // issue in libspng prevents direct rendering of GA8 and GA16
-    // see: https://github.com/randy408/libspng/issues/207
-    if (fmt == 0 && (render_fmt == SPNG_FMT_GA8 || render_fmt == SPNG_FMT_GA16)) {
-        render_fmt = SPNG_FMT_PNG;
+    if (out.ndim() != 2 && out.ndim() != 3) {
+        throw py::value_error("pyspng: out must be a 2D or 3D array.");
+    }
+    if (out.dtype().kind() != 'u' || out.itemsize() > 2) {
+        throw py::value_error("pyspng: out must be a uint8 or uint16 array.");
     }
+    // samples are written in native byte order
+    if (!out.dtype().attr("isnative").cast<bool>()) {
+        throw py::value_error("pyspng: out must be in native byte order.");
+    }
+
+    pyspng::OutputView view;
+    view.data = out.mutable_data(); // raises if the array is read-only
+    view.strides[0] = out.strides(0);
+    view.strides[1] = out.strides(1);
+    view.strides[2] = (out.ndim() == 3) ? out.strides(2) : out.itemsize();
 
-    if ((res = spng_decoded_image_size(ctx.get(), render_fmt, &out_size)) != SPNG_OK) {
-        throw std::runtime_error("pyspng: could not decode image size: " + std::string(spng_strerror(res)));
+    const size_t height = out.shape(0);
+    const size_t width = out.shape(1);
+    const size_t channels = (out.ndim() == 3) ? out.shape(2) : 1;
+    const size_t sample_bytes = out.itemsize();
+
+    {
+        py::gil_scoped_release release;
+        pyspng::DecodePlan plan = open_instrumented(open_plan, stats);
+        if (!has_region) {
+            region = pyspng::full_region(plan);
+        }
+        pyspng::check_region(plan, region);
+
+        if (
+            height != region.height() || width != region.width()
+            || channels != plan.channels || sample_bytes != plan.sample_bytes
+        ) {
+            throw py::value_error(
+                "pyspng: out has shape (" + std::to_string(height) + ", " + std::to_string(width)
+                + ", " + std::to_string(channels) + ") and " + std::to_string(sample_bytes * 8)
+                + " bit samples but the image decodes to shape (" + std::to_string(region.height())
+                + ", " + std::to_string(region.width()) + ", " + std::to_string(plan.channels)
+                + ") with " + std::to_string(plan.sample_bytes * 8) + " bit samples."
+            );
+        }
+
+        ScopedTimer timer(stats ? &stats->codec_ns : NULL);
+        pyspng::decode_into(plan, view, region);
     }
 
-    void* data = (void*)malloc(out_size);
-    if ((res = spng_decode_image(ctx.get(), data, out_size, render_fmt, 0)) != SPNG_OK) {
-        free(data); 
-        throw std::runtime_error("pyspng: could not decode image: " + std::string(spng_strerror(res)));
+    if (stats) {
+        stats->output_bytes = height * width * channels * sample_bytes;
     }
+    return out;
+}
 
-    py::capsule free_when_done(data, [](void *f) {
-        free(f);
-    });
+// Decodes png_bits into out (which may be None), returning
+// the image, or (image, stats dict) if with_stats.
+py::object decode_bytes(
+    const py::object &png_bits, spng_format fmt,
+    const py::object &out, const py::object &region,
+    const int max_pass, const bool nearest_fill,
+    const bool with_stats
+) {
+    const uint64_t start = with_stats ? pyspng::clock_ns() : 0;
+    CallStats stats;
+    CallStats *s = with_stats ? &stats : NULL;
 
-    return py::array(
-        cs == 1 ? py::dtype("uint8") : py::dtype("uint16"),
-        {h, w, nc},              // shape
-        {w*nc*cs, nc*cs, cs},    // index strides in bytes
-        (uint8_t*)data,          // the data pointer
-        free_when_done           // numpy array references this parent
-    );
+    std::unique_ptr<InputBuffer> bits;
+    {
+        ScopedTimer timer(s ? &s->input_ns : NULL);
+        bits.reset(new InputBuffer(png_bits));
+    }
+
+    py::array image = decode_planned([&]() {
+        return pyspng::plan_decode(bits->data(), bits->size(), fmt);
+    }, out, region, max_pass, nearest_fill, s);
+
+    if (!with_stats) {
+        return image;
+    }
+
+    stats.input_bytes = bits->size();
+    return py::make_tuple(image, stats_dict(stats, true, pyspng::clock_ns() - start));
+}
+
+// An indexed PNG's palette indices and its palette,
+// (n, 3) or (n, 4) if the PNG has a tRNS chunk.
+py::tuple decode_image_indices(const py::object &png_bits) {
+    InputBuffer bits(png_bits);
+
+    DecodedImage image;
+    pyspng::Palette palette;
+    {
+        py::gil_scoped_release release;
+        // the format only matters to the size check, indices aren't expanded
+        pyspng::DecodePlan plan = pyspng::plan_decode(bits.data(), bits.size(), SPNG_FMT_RGB8);
+        image = pyspng::decode_indices(plan, palette);
+    }
+
+    const py::ssize_t n = palette.size;
+    const py::ssize_t nc = palette.has_alpha ? 4 : 3;
+    const std::vector<py::ssize_t> shape = { n, nc };
+    py::array_t<uint8_t> entries(shape);
+    uint8_t *dest = entries.mutable_data();
+    for (py::ssize_t i = 0; i < n; i++) {
+        memcpy(dest + i * nc, palette.rgba[i], nc);
+    }
+
+    return py::make_tuple(to_numpy(image), entries);
+}
+
+py::object decode_image_bytes(
+    const py::object &png_bits, spng_format fmt,
+    const py::object &region = py::none(),
+    const int max_pass = 0, const bool nearest_fill = false,
+    const bool with_stats = false
+) {
+    return decode_bytes(png_bits, fmt, py::none(), region, max_pass, nearest_fill, with_stats);
+}
+
+py::object decode_image_into(
+    const py::object &png_bits, spng_format fmt, py::array out,
+    const py::object &region = py::none(),
+    const bool with_stats = false
+) {
+    return decode_bytes(png_bits, fmt, out, region, 0, false, with_stats);
+}
+
+py::array decode_file(
+    const std::string &path, spng_format fmt,
+    const py::object &out, const py::object &region,
+    const int max_pass, const bool nearest_fill
+) {
+    pyspng::file_ptr file(NULL, fclose);
+    return decode_planned([&]() {
+        file = pyspng::open_file(path, "rb");
+        return pyspng::plan_decode(file.get(), fmt);
+    }, out, region, max_pass, nearest_fill);
+}
+
+py::array decode_stream(
+    const py::object &fileobj, spng_format fmt,
+    const py::object &out, const py::object &region,
+    const int max_pass, const bool nearest_fill
+) {
+    PyFileReader reader(fileobj);
+    try {
+        return decode_planned([&]() {
+            return pyspng::plan_decode(PyFileReader::read_fn, &reader, fmt);
+        }, out, region, max_pass, nearest_fill);
+    }
+    catch (const std::exception &) {
+        reader.py_error.rethrow_if_pending();
+        throw;
+    }
+}
+
+py::tuple decode_many(const py::list &datas, spng_format fmt, const size_t threads) {
+    const size_t n = datas.size();
+
+    // Holding the buffers keeps them alive while the
+    // GIL is released, even if the list is mutated.
+    std::vector<InputBuffer> buffers;
+    buffers.reserve(n);
+    for (size_t i = 0; i < n; i++) {
+        py::object item = datas[i];
+        buffers.push_back(InputBuffer(item));
+    }
+
+    std::vector<DecodedImage> images(n);
+    std::vector<std::string> errors(n);
+    std::vector<uint8_t> failed(n, 0);
+
+    {
+        py::gil_scoped_release release;
+        pyspng::parallel_for(n, threads, [&](const size_t i) {
+            try {
+                images[i] = pyspng::decode(buffers[i].data(), buffers[i].size(), fmt);
+            }
+            catch (const std::exception &e) {
+                errors[i] = e.what();
+                failed[i] = 1;
+            }
+        });
+    }
+
+    py::list results(n);
+    py::list messages(n);
+    for (size_t i = 0; i < n; i++) {
+        if (failed[i]) {
+            results[i] = py::none();
+            messages[i] = py::str(errors[i]);
+        }
+        else {
+            results[i] = to_numpy(images[i]);
+            messages[i] = py::none();
+        }
+    }
+
+    return py::make_tuple(results, messages);
 }
 
 PYBIND11_MODULE(_pyspng_c, m) {
@@ -285,11 +854,36 @@ PYBIND11_MODULE(_pyspng_c, m) {
            :toctree: _generate
 
            spng_format
+           spng_filter_choice
+           EncodeOptions
+           deflate_backend
            spng_read_header
            spng_encode_image
            spng_decode_image_bytes
+           spng_decode_image_indices
+           spng_decode_image_into
+           spng_encode_many
+           spng_decode_many
+           spng_encode_file
+           spng_encode_stream
+           spng_decode_file
+           spng_decode_stream
+           IncrementalDecoder
     )pbdoc";
 
+    py::register_exception_translator([](std::exception_ptr p) {
+        try {
+            if (p) {
+                std::rethrow_exception(p);
+            }
+        }
+        catch (const pyspng::FileError &e) {
+            // OSError subclass by errno, e.g. FileNotFoundError
+            errno = e.error;
+            PyErr_SetFromErrnoWithFilename(PyExc_OSError, e.path.c_str());
+        }
+    });
+
     py::enum_<spng_format>(m, "spng_format")
         .value("SPNG_FMT_AUTO",   (spng_format)0) // Note: not a libspng enum value
         .value("SPNG_FMT_RGBA8",  SPNG_FMT_RGBA8)
@@ -300,6 +894,54 @@ PYBIND11_MODULE(_pyspng_c, m) {
         .value("SPNG_FMT_G8",     SPNG_FMT_G8)
         .export_values();
 
+    py::enum_<spng_filter_choice>(m, "spng_filter_choice")
+        .value("SPNG_DISABLE_FILTERING",    SPNG_DISABLE_FILTERING)
+        .value("SPNG_FILTER_CHOICE_NONE",   SPNG_FILTER_CHOICE_NONE)
+        .value("SPNG_FILTER_CHOICE_SUB",    SPNG_FILTER_CHOICE_SUB)
+        .value("SPNG_FILTER_CHOICE_UP",     SPNG_FILTER_CHOICE_UP)
+        .value("SPNG_FILTER_CHOICE_AVG",    SPNG_FILTER_CHOICE_AVG)
+        .value("SPNG_FILTER_CHOICE_PAETH",  SPNG_FILTER_CHOICE_PAETH)
+        .value("SPNG_FILTER_CHOICE_ALL",    SPNG_FILTER_CHOICE_ALL)
+        .export_values();
+
+    m.attr("FILTER_CHOICE_FAST") = pyspng::FILTER_CHOICE_FAST;
+    m.attr("deflate_backend") = pyspng::deflate_backend();
+
+    py::class_<EncodeOptions>(m, "EncodeOptions", R"pbdoc(
+        Filtering and deflate settings for the encoders.
+
+        Args:
+            compress_level (int): 0-9 input to zlib/miniz
+            filter_choice (int): Bitwise or of spng_filter_choice values,
+                FILTER_CHOICE_FAST to pick one filter for the whole image
+                from a sample of rows, or -1 for libspng's default (all
+                filters, none at compress_level 0).
+            strategy (int): zlib strategy, 0: default, 1: filtered,
+                2: huffman only, 3: rle, 4: fixed. -1 picks filtered
+                when rows are filtered and default otherwise.
+            window_bits (int): 9-15, log2 of the deflate window size.
+                Only 15 is supported when built with miniz.
+            mem_level (int): 1-9, memory used by deflate's match finder.
+            reduce (bool): Write 8-bit grayscale whose values fit in
+                1, 2 or 4 bits at that bit depth and 8-bit RGB(A) with
+                at most 256 colors as an indexed PNG. Either decodes
+                back to the same array (RGBA with fmt SPNG_FMT_RGBA8).
+    )pbdoc")
+        .def(py::init<int, int, int, int, int, bool>(),
+            py::arg("compress_level") = 6, py::arg("filter_choice") = -1,
+            py::arg("strategy") = -1, py::arg("window_bits") = 15,
+            py::arg("mem_level") = 8, py::arg("reduce") = false)
+        .def_readwrite("compress_level", &EncodeOptions::compress_level)
+        .def_readwrite("filter_choice", &EncodeOptions::filter_choice)
+        .def_readwrite("strategy", &EncodeOptions::strategy)
+        .def_readwrite("window_bits", &EncodeOptions::window_bits)
+        .def_readwrite("mem_level", &EncodeOptions::mem_level)
+        .def_readwrite("reduce", &EncodeOptions::reduce)
+        .def("validate", &EncodeOptions::validate,
+            "Raise ValueError if any setting is out of range.");
+
+    py::implicitly_convertible<py::int_, EncodeOptions>();
+
     m.def("spng_read_header", &read_header, py::arg("data"), R"pbdoc(
         Read the header of the PNG file and return it as a dict with
         keys to integer values.
@@ -311,9 +953,9 @@ PYBIND11_MODULE(_pyspng_c, m) {
         }
     )pbdoc");
 
-    m.def("spng_encode_image", 
-        &encode_image, py::arg("image"), py::arg("progressive"), 
-        py::arg("compress_level"), R"pbdoc(
+    m.def("spng_encode_image",
+        &encode_image, py::arg("image"), py::arg("progressive"),
+        py::arg("options"), py::arg("threads") = 1, py::arg("stats") = false, R"pbdoc(
         Encode a Numpy array into a PNG bytestream.
 
         Note:
@@ -328,18 +970,35 @@ PYBIND11_MODULE(_pyspng_c, m) {
 
         Args:
             image (numpy.ndarray): A 2D image potentially with multiple channels.
-            progressive (int): 
+            progressive (int):
                 0: off, regular PNG
                 1: on, progressive PNG
                 2: on, interlaced progressive PNG
 
                 Also see ProgressiveMode enum.
-            compress_level (int): 0-9 input to zlib/miniz
+            options (EncodeOptions or int): Filtering and deflate
+                settings. An int is taken as the compress_level.
+            threads (int): Number of threads to filter and deflate
+                horizontal strips of the image with. 0 means one
+                per core. Ignored for interlaced images and for
+                images too small to be worth splitting.
+            stats (bool): Also return where the time went, see below.
         Returns:
             bytes: A valid PNG bytestream.
+            (bytes, dict) if stats: the dict holds nanosecond timings
+                (total_ns, input_ns, chunks_ns, deflate_ns, filter_ns,
+                convert_ns, alloc_ns), byte counts (input_bytes,
+                idat_bytes, deflated_bytes, output_bytes), the number
+                of scanlines, how many used each filter ("filters") and
+                the filter type of each scanline ("row_filters", uint8
+                array). With threads the stage times are summed over
+                threads.
     )pbdoc");
 
-    m.def("spng_decode_image_bytes", &decode_image_bytes, py::arg("data"), py::arg("fmt"), R"pbdoc(
+    m.def("spng_decode_image_bytes", &decode_image_bytes,
+        py::arg("data"), py::arg("fmt"), py::arg("region") = py::none(),
+        py::arg("max_pass") = 0, py::arg("nearest_fill") = false,
+        py::arg("stats") = false, R"pbdoc(
         Decode PNG bytes into a numpy array.
 
         Note:
@@ -348,13 +1007,220 @@ PYBIND11_MODULE(_pyspng_c, m) {
             PIL.Image compatible shapes.
 
         Args:
-            data (bytes): PNG file contents in memory.
+            data (bytes-like): PNG file contents in memory. Any C-contiguous
+                buffer protocol object (bytes, bytearray, memoryview, mmap)
+                is read in place without copying.
             fmt: Output format.  SPNG_FMT_AUTO will auto-detect the output format based on PNG contents.
+            region (tuple, optional): (y0, y1, x0, x1) decodes only rows
+                y0 <= y < y1 and columns x0 <= x < x1. Rows above y0 are
+                inflated but not kept and inflating stops after row y1 - 1
+                is complete, so only the crop is allocated.
+            max_pass (int): 1-7 returns only the pixels of Adam7 passes
+                1 to max_pass, inflating no further than that. 0 decodes
+                the full image. Cannot be combined with region.
+            nearest_fill (bool): With max_pass, upsample the preview to
+                full size by repeating pixels instead of returning it
+                subsampled (e.g. ceil(h/8) x ceil(w/8) for pass 1).
+            stats (bool): Also return where the time went, see below.
+
+        Returns:
+            numpy.ndarray: Image pixel data in shape (height, width, nc),
+                or the shape of the region or preview.
+            (numpy.ndarray, dict) if stats: the dict holds nanosecond
+                timings (total_ns, input_ns, header_ns, chunks_ns,
+                inflate_ns, unfilter_ns, convert_ns, alloc_ns), byte
+                counts (input_bytes, idat_bytes, inflated_bytes,
+                output_bytes), the number of scanlines decoded, how
+                many used each filter ("filters") and the filter type
+                of each one ("row_filters", uint8 array).
+
+    )pbdoc");
+
+    m.def("spng_decode_image_indices", &decode_image_indices, py::arg("data"), R"pbdoc(
+        Decode an indexed PNG without applying its palette.
+
+        Args:
+            data (bytes-like): PNG file contents in memory.
+
+        Returns:
+            (numpy.ndarray, numpy.ndarray): uint8 palette indices in
+                shape (height, width, 1) at any bit depth, and the uint8
+                palette in shape (n, 3), or (n, 4) with the tRNS alpha
+                if the PNG has one.
+    )pbdoc");
+
+    m.def("spng_decode_image_into", &decode_image_into,
+        py::arg("data"), py::arg("fmt"), py::arg("out"),
+        py::arg("region") = py::none(), py::arg("stats") = false, R"pbdoc(
+        Decode PNG bytes directly into a preallocated numpy array.
+
+        Args:
+            data (bytes-like): PNG file contents in memory.
+            fmt: Output format. See spng_decode_image_bytes.
+            out (numpy.ndarray): Writable uint8 or uint16 array of shape
+                (height, width, nc), or (height, width) for single channel
+                output. It may be strided (e.g. a slice of a larger array).
+            region (tuple, optional): (y0, y1, x0, x1) as in
+                spng_decode_image_bytes. out must then have the shape
+                of the region.
+            stats (bool): See spng_decode_image_bytes.
 
         Returns:
-            numpy.ndarray: Image pixel data in shape (height, width, nc).
+            numpy.ndarray: out, or (out, dict) if stats.
+    )pbdoc");
+
+    m.def("spng_encode_many",
+        &encode_many, py::arg("images"), py::arg("progressive"),
+        py::arg("options"), py::arg("threads"), R"pbdoc(
+        Encode a list of C-contiguous Numpy arrays into PNG bytestreams
+        in parallel with the GIL released.
 
+        Args:
+            images (list of numpy.ndarray): Images as accepted by spng_encode_image.
+            progressive (int): See spng_encode_image.
+            options (EncodeOptions or int): See spng_encode_image.
+            threads (int): Number of worker threads. 0 means one per core.
+
+        Returns:
+            (list, list): The PNG bytestreams in input order (None where
+                encoding failed) and the matching error messages (None
+                where encoding succeeded).
     )pbdoc");
+
+    m.def("spng_decode_many", &decode_many, py::arg("datas"), py::arg("fmt"), py::arg("threads"), R"pbdoc(
+        Decode a list of PNG bytes objects into numpy arrays in parallel
+        with the GIL released.
+
+        Args:
+            datas (list of bytes): PNG file contents in memory.
+            fmt: Output format applied to every image. See spng_decode_image_bytes.
+            threads (int): Number of worker threads. 0 means one per core.
+
+        Returns:
+            (list, list): Arrays of shape (height, width, nc) in input order
+                (None where decoding failed) and the matching error messages
+                (None where decoding succeeded).
+    )pbdoc");
+
+    m.def("spng_encode_file",
+        &encode_file, py::arg("path"), py::arg("image"), py::arg("progressive"),
+        py::arg("options"), py::arg("threads"), R"pbdoc(
+        Encode a C-contiguous Numpy array into a PNG file.
+
+        The PNG is streamed to disk through a fixed size buffer with
+        the GIL released rather than built in memory first. A partially
+        written file is removed if encoding fails.
+
+        Args:
+            path (str): Destination file path.
+            image (numpy.ndarray): See spng_encode_image.
+            progressive (int): See spng_encode_image.
+            options (EncodeOptions or int): See spng_encode_image.
+            threads (int): See spng_encode_image. The compressed strips
+                are held in memory until they are all done.
+    )pbdoc");
+
+    m.def("spng_encode_stream",
+        &encode_stream, py::arg("file"), py::arg("image"), py::arg("progressive"),
+        py::arg("options"), py::arg("threads"), R"pbdoc(
+        Encode a C-contiguous Numpy array into a binary file-like object.
+
+        Encoding runs with the GIL released. The output is collected in a
+        fixed size buffer and the GIL is only taken to call file.write().
+
+        Args:
+            file: Object with a write(bytes) method.
+            image (numpy.ndarray): See spng_encode_image.
+            progressive (int): See spng_encode_image.
+            options (EncodeOptions or int): See spng_encode_image.
+            threads (int): See spng_encode_file.
+    )pbdoc");
+
+    m.def("spng_decode_file", &decode_file,
+        py::arg("path"), py::arg("fmt"), py::arg("out") = py::none(),
+        py::arg("region") = py::none(), py::arg("max_pass") = 0,
+        py::arg("nearest_fill") = false, R"pbdoc(
+        Decode a PNG file into a numpy array.
+
+        The file is read through a fixed size buffer with the GIL released
+        instead of being loaded into memory first.
+
+        Args:
+            path (str): PNG file path.
+            fmt: Output format. See spng_decode_image_bytes.
+            out (numpy.ndarray, optional): See spng_decode_image_into.
+            region (tuple, optional): See spng_decode_image_bytes.
+            max_pass (int): See spng_decode_image_bytes. Reading stops
+                once the requested passes are decoded.
+            nearest_fill (bool): See spng_decode_image_bytes.
+
+        Returns:
+            numpy.ndarray: out if given, else a new array of shape (height, width, nc).
+    )pbdoc");
+
+    m.def("spng_decode_stream", &decode_stream,
+        py::arg("file"), py::arg("fmt"), py::arg("out") = py::none(),
+        py::arg("region") = py::none(), py::arg("max_pass") = 0,
+        py::arg("nearest_fill") = false, R"pbdoc(
+        Decode a PNG from a binary file-like object into a numpy array.
+
+        Decoding runs with the GIL released. The GIL is only taken to
+        refill a fixed size buffer with file.read().
+
+        Args:
+            file: Object with a read(size) method returning bytes.
+            fmt: Output format. See spng_decode_image_bytes.
+            out (numpy.ndarray, optional): See spng_decode_image_into.
+            region (tuple, optional): See spng_decode_image_bytes.
+            max_pass (int): See spng_decode_image_bytes. Reading stops
+                once the requested passes are decoded.
+            nearest_fill (bool): See spng_decode_image_bytes.
+
+        Returns:
+            numpy.ndarray: out if given, else a new array of shape (height, width, nc).
+    )pbdoc");
+
+    py::class_<pyspng::IncrementalDecoder>(m, "IncrementalDecoder", R"pbdoc(
+        Decodes a PNG while its bytes are still arriving.
+
+        Decoding runs on a background thread as data is fed,
+        independent of the GIL.
+    )pbdoc")
+        .def(py::init<spng_format>(), py::arg("fmt"))
+        .def("feed", [](pyspng::IncrementalDecoder &decoder, const py::object &data) {
+            InputBuffer bits(data);
+            decoder.feed(bits.data(), bits.size());
+        }, py::arg("data"), R"pbdoc(
+            Append the next piece of the PNG (any bytes-like object, copied).
+        )pbdoc")
+        .def("finish", [](const py::object &self) {
+            pyspng::IncrementalDecoder &decoder = self.cast<pyspng::IncrementalDecoder&>();
+            {
+                py::gil_scoped_release release;
+                decoder.finish();
+            }
+            return incremental_image(self);
+        }, R"pbdoc(
+            Mark the end of the input, wait for decoding to complete and
+            return the image of shape (height, width, nc).
+        )pbdoc")
+        .def_property_readonly("header", [](const pyspng::IncrementalDecoder &decoder) -> py::object {
+            if (!decoder.header_ready()) {
+                return py::none();
+            }
+            return header_dict(decoder.header());
+        }, "The IHDR as a dict like spng_read_header, or None until it has arrived.")
+        .def_property_readonly("image", [](const py::object &self) -> py::object {
+            if (!self.cast<pyspng::IncrementalDecoder&>().header_ready()) {
+                return py::none();
+            }
+            return incremental_image(self);
+        }, "The image being decoded (None until the header has arrived). Only rows_complete rows are final.")
+        .def_property_readonly("rows_complete", &pyspng::IncrementalDecoder::rows_complete,
+            "Number of leading rows that are fully decoded.")
+        .def_property_readonly("done", &pyspng::IncrementalDecoder::finished,
+            "Whether decoding has ended, successfully or not.");
+
 #ifdef VERSION_INFO
     m.attr("__version__") = MACRO_STRINGIFY(VERSION_INFO);
 #else
@@ -0,0 +1,320 @@
+/*
+ * Indexed color and low bit depth images.
+ *
+ * reduce_image finds 8-bit images that can be stored losslessly in
+ * fewer bits, e.g. mask and label tiles: grayscale that only uses the
+ * levels of a 1, 2 or 4-bit image (0 and 255 for a mask) and RGB(A)
+ * with at most 256 distinct colors, which becomes an indexed PNG.
+ * Both decode back to the same array.
+ * decode_indices is the other direction for indexed PNGs, returning
+ * the palette indices instead of expanding them to RGB(A).
+ */
+
+#ifndef __PYSPNG_PALETTE_HPP__
+#define __PYSPNG_PALETTE_HPP__
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "spng.h"
+
+#include "codec.hpp"
+
+namespace pyspng {
+
+// Packs n values below 2^bits, one per byte, into a PNG scanline.
+inline void pack_row(uint8_t *dest, const uint8_t *src, const size_t n, const size_t bits) {
+    if (bits == 8) {
+        memcpy(dest, src, n);
+        return;
+    }
+
+    const size_t per_byte = 8 / bits;
+    size_t x = 0;
+    for (; x + per_byte <= n; x += per_byte) {
+        unsigned int byte = 0;
+        for (size_t i = 0; i < per_byte; i++) {
+            byte = (byte << bits) | src[x + i];
+        }
+        *dest++ = static_cast<uint8_t>(byte);
+    }
+    if (x < n) {
+        // the last byte is padded with zero bits on the right
+        unsigned int byte = 0;
+        for (size_t i = 0; i < per_byte; i++) {
+            byte = (byte << bits) | (x + i < n ? src[x + i] : 0);
+        }
+        *dest = static_cast<uint8_t>(byte);
+    }
+}
+
+// Unpacks n samples of a PNG scanline at bits per sample, one per byte.
+inline void unpack_row(uint8_t *dest, const uint8_t *src, const size_t n, const size_t bits) {
+    if (bits == 8) {
+        memcpy(dest, src, n);
+        return;
+    }
+
+    const unsigned int mask = (1u << bits) - 1;
+    const size_t per_byte = 8 / bits;
+    for (size_t x = 0; x < n; x++) {
+        const size_t shift = 8 - bits * (x % per_byte + 1);
+        dest[x] = static_cast<uint8_t>((src[x / per_byte] >> shift) & mask);
+    }
+}
+
+inline size_t bits_for(const size_t levels) {
+    if (levels <= 2) return 1;
+    if (levels <= 4) return 2;
+    if (levels <= 16) return 4;
+    return 8;
+}
+
+// An image rewritten by reduce_image. view points into rows and
+// palette, so this must not be copied or moved while in use.
+struct ReducedImage {
+    std::vector<uint8_t> rows;
+    Palette palette;
+    ImageView view;
+};
+
+// Grayscale at 1, 2 or 4 bits when every value is on that bit depth's
+// scale, e.g. 0 and 255 for 1 bit. Decoders scale low bit depth gray
+// samples up to 8 bits (v * 255 / (2^bits - 1)), so only those values
+// come back unchanged.
+inline bool reduce_gray(const ImageView &image, ReducedImage &out) {
+    const uint8_t *pixels = static_cast<const uint8_t*>(image.data);
+    const size_t n = image.height * image.width;
+
+    uint8_t seen[256] = { 0 };
+    for (size_t i = 0; i < n; i++) {
+        seen[pixels[i]] = 1;
+    }
+
+    size_t bits = 0;
+    for (size_t b = 1; b <= 4 && !bits; b *= 2) {
+        const unsigned int step = 255 / ((1u << b) - 1);
+        bool fits = true;
+        for (unsigned int v = 0; v < 256 && fits; v++) {
+            fits = !seen[v] || v % step == 0;
+        }
+        if (fits) {
+            bits = b;
+        }
+    }
+    if (!bits) {
+        return false;
+    }
+
+    out.view = image;
+    out.view.packed_bits = bits;
+    out.view.palette = NULL;
+
+    const unsigned int step = 255 / ((1u << bits) - 1);
+    std::vector<uint8_t> scaled(image.width);
+    const size_t row_bytes = out.view.row_bytes();
+    out.rows.resize(image.height * row_bytes);
+    for (size_t y = 0; y < image.height; y++) {
+        const uint8_t *row = pixels + y * image.width;
+        for (size_t x = 0; x < image.width; x++) {
+            scaled[x] = static_cast<uint8_t>(row[x] / step);
+        }
+        pack_row(out.rows.data() + y * row_bytes, scaled.data(), image.width, bits);
+    }
+    out.view.data = out.rows.data();
+    return true;
+}
+
+// RGB or RGBA with at most 256 distinct colors as palette indices.
+inline bool reduce_color(const ImageView &image, ReducedImage &out) {
+    const uint8_t *pixels = static_cast<const uint8_t*>(image.data);
+    const size_t nc = image.channels;
+    const size_t n = image.height * image.width;
+
+    // Open addressing, 4x the most colors that can fit so probe
+    // sequences stay short. Runs of one color skip the lookup.
+    const size_t TABLE_SIZE = 1024;
+    uint32_t keys[TABLE_SIZE];
+    int16_t slots[TABLE_SIZE];
+    std::fill(slots, slots + TABLE_SIZE, -1);
+
+    uint32_t colors[256];
+    size_t ncolors = 0;
+
+    std::vector<uint8_t> indices(n);
+    uint32_t last_key = 0;
+    uint8_t last_index = 0;
+    bool have_last = false;
+
+    for (size_t i = 0; i < n; i++) {
+        const uint8_t *px = pixels + i * nc;
+        const uint32_t key = static_cast<uint32_t>(px[0])
+            | (static_cast<uint32_t>(px[1]) << 8)
+            | (static_cast<uint32_t>(px[2]) << 16)
+            | (static_cast<uint32_t>(nc == 4 ? px[3] : 255) << 24);
+
+        if (have_last && key == last_key) {
+            indices[i] = last_index;
+            continue;
+        }
+
+        size_t slot = (key * 2654435761u) >> 22;
+        while (slots[slot] >= 0 && keys[slot] != key) {
+            slot = (slot + 1) & (TABLE_SIZE - 1);
+        }
+        if (slots[slot] < 0) {
+            if (ncolors == 256) {
+                return false;
+            }
+            keys[slot] = key;
+            slots[slot] = static_cast<int16_t>(ncolors);
+            colors[ncolors++] = key;
+        }
+
+        last_key = key;
+        last_index = static_cast<uint8_t>(slots[slot]);
+        have_last = true;
+        indices[i] = last_index;
+    }
+
+    // Translucent entries first, so that tRNS can stop at the last of them.
+    uint8_t remap[256];
+    Palette &palette = out.palette;
+    palette.size = 0;
+    palette.has_alpha = false;
+    for (int pass = 0; pass < 2; pass++) {
+        for (size_t c = 0; c < ncolors; c++) {
+            const bool opaque = (colors[c] >> 24) == 255;
+            if (opaque != (pass == 1)) {
+                continue;
+            }
+            remap[c] = static_cast<uint8_t>(palette.size);
+            for (int k = 0; k < 4; k++) {
+                palette.rgba[palette.size][k] = static_cast<uint8_t>(colors[c] >> (8 * k));
+            }
+            palette.has_alpha = palette.has_alpha || !opaque;
+            palette.size++;
+        }
+    }
+    for (size_t i = 0; i < n; i++) {
+        indices[i] = remap[indices[i]];
+    }
+
+    out.view = image;
+    out.view.channels = 1;
+    out.view.packed_bits = bits_for(ncolors);
+    out.view.palette = &out.palette;
+
+    const size_t row_bytes = out.view.row_bytes();
+    out.rows.resize(image.height * row_bytes);
+    for (size_t y = 0; y < image.height; y++) {
+        pack_row(out.rows.data() + y * row_bytes, indices.data() + y * image.width, image.width, out.view.packed_bits);
+    }
+    out.view.data = out.rows.data();
+    return true;
+}
+
+// Rewrites image into out if it can be stored in fewer bits without
+// changing what it decodes to. Returns false, leaving out unused,
+// for 16-bit and gray+alpha images and images that don't qualify.
+inline bool reduce_image(const ImageView &image, ReducedImage &out) {
+    if (image.sample_bytes != 1 || image.packed_bits) {
+        return false;
+    }
+    if (image.channels == 1) {
+        return reduce_gray(image, out);
+    }
+    if (image.channels == 3 || image.channels == 4) {
+        return reduce_color(image, out);
+    }
+    return false;
+}
+
+inline void read_palette(spng_ctx *ctx, Palette &palette) {
+    struct spng_plte plte;
+    int res;
+    if ((res = spng_get_plte(ctx, &plte)) != SPNG_OK) {
+        throw std::runtime_error("pyspng: could not read palette: " + std::string(spng_strerror(res)));
+    }
+
+    struct spng_trns trns;
+    if (spng_get_trns(ctx, &trns) != SPNG_OK) {
+        trns.n_type3_entries = 0;
+    }
+
+    palette.size = plte.n_entries;
+    palette.has_alpha = trns.n_type3_entries > 0;
+    for (size_t i = 0; i < palette.size; i++) {
+        palette.rgba[i][0] = plte.entries[i].red;
+        palette.rgba[i][1] = plte.entries[i].green;
+        palette.rgba[i][2] = plte.entries[i].blue;
+        palette.rgba[i][3] = i < trns.n_type3_entries ? trns.type3_alpha[i] : 255;
+    }
+}
+
+// Decodes an indexed PNG to one uint8 palette index per pixel
+// and its palette, without expanding the indices to colors.
+inline DecodedImage decode_indices(DecodePlan &plan, Palette &palette) {
+    const struct spng_ihdr &ihdr = plan.ihdr;
+    if (ihdr.color_type != SPNG_COLOR_TYPE_INDEXED) {
+        throw std::invalid_argument(
+            "pyspng: raw_indices requires an indexed PNG. Got color type "
+            + std::to_string(ihdr.color_type) + "."
+        );
+    }
+
+    spng_ctx *ctx = plan.ctx.get();
+    read_palette(ctx, palette);
+
+    int res;
+    size_t packed_size;
+    if ((res = spng_decoded_image_size(ctx, SPNG_FMT_PNG, &packed_size)) != SPNG_OK) {
+        throw std::runtime_error("pyspng: could not decode image size: " + std::string(spng_strerror(res)));
+    }
+
+    const size_t width = ihdr.width;
+    const size_t height = ihdr.height;
+    uint8_t *data = static_cast<uint8_t*>(malloc(width * height));
+    if (data == NULL) {
+        throw std::runtime_error("pyspng: unable to allocate " + std::to_string(width * height) + " bytes.");
+    }
+
+    try {
+        // 8-bit indices are already one per byte
+        std::vector<uint8_t> packed(ihdr.bit_depth == 8 ? 0 : packed_size);
+        uint8_t *dest = ihdr.bit_depth == 8 ? data : packed.data();
+
+        if ((res = spng_decode_image(ctx, dest, packed_size, SPNG_FMT_PNG, 0)) != SPNG_OK) {
+            throw std::runtime_error("pyspng: could not decode image: " + std::string(spng_strerror(res)));
+        }
+
+        if (ihdr.bit_depth != 8) {
+            const size_t row_bytes = packed_size / height;
+            for (size_t y = 0; y < height; y++) {
+                unpack_row(data + y * width, packed.data() + y * row_bytes, width, ihdr.bit_depth);
+            }
+        }
+    }
+    catch (...) {
+        free(data);
+        throw;
+    }
+
+    DecodedImage image;
+    image.data = data;
+    image.height = height;
+    image.width = width;
+    image.channels = 1;
+    image.sample_bytes = 1;
+    return image;
+}
+
+};
+
+#endif
@@ -0,0 +1,158 @@
+/*
+ * Minimal fan-out helper for running independent work items
+ * on a handful of native threads.
+ *
+ * Workers pull the next item index from a shared atomic counter,
+ * so a thread that finishes a cheap item immediately picks up
+ * more work instead of idling behind a fixed partition.
+ *
+ * The helper threads are created on first use and kept for the life
+ * of the process, so a batch of small tiles doesn't pay for starting
+ * and joining threads on every call. The calling thread always works
+ * on its own batch too and only waits for items that a helper has
+ * already started, so a batch finishes even if every helper is busy
+ * elsewhere (or, after a fork, doesn't exist).
+ */
+
+#ifndef __PYSPNG_PARALLEL_HPP__
+#define __PYSPNG_PARALLEL_HPP__
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+namespace pyspng {
+
+// Resolve a user supplied thread count. 0 means
+// "one thread per hardware core".
+inline size_t resolve_threads(size_t threads, const size_t num_items) {
+    if (threads == 0) {
+        threads = std::thread::hardware_concurrency();
+    }
+    threads = std::min(threads, num_items);
+    return std::max(threads, static_cast<size_t>(1));
+}
+
+// One parallel_for call. Helpers hold it by shared_ptr, so one that
+// only gets to it after the call returned finds no items left and
+// never touches fn.
+class ParallelJob {
+public:
+    ParallelJob(const size_t n_, std::function<void(size_t)> fn_)
+        : n(n_), fn(std::move(fn_)), next(0), done(0) {}
+
+    void work() {
+        size_t i;
+        size_t count = 0;
+        while ((i = next.fetch_add(1)) < n) {
+            fn(i);
+            count++;
+        }
+        if (count && done.fetch_add(count) + count == n) {
+            std::lock_guard<std::mutex> lock(mutex);
+            finished.notify_all();
+        }
+    }
+
+    void wait() {
+        std::unique_lock<std::mutex> lock(mutex);
+        finished.wait(lock, [this]() { return done.load() == n; });
+    }
+
+private:
+    const size_t n;
+    std::function<void(size_t)> fn;
+    std::atomic<size_t> next;
+    std::atomic<size_t> done;
+    std::mutex mutex;
+    std::condition_variable finished;
+};
+
+class WorkerPool {
+public:
+    // Never destroyed: the workers are detached and may
+    // still be waiting for work when the process exits.
+    static WorkerPool &instance() {
+        static WorkerPool *pool = new WorkerPool();
+        return *pool;
+    }
+
+    // Queues job for up to helpers workers, starting more if needed.
+    void submit(const std::shared_ptr<ParallelJob> &job, const size_t helpers) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            try {
+                while (workers < helpers) {
+                    std::thread(&WorkerPool::run, this).detach();
+                    workers++;
+                }
+            }
+            catch (const std::system_error &) {
+                // out of threads, the caller and existing workers will do
+            }
+            for (size_t i = 0; i < helpers; i++) {
+                queue.push_back(job);
+            }
+        }
+        available.notify_all();
+    }
+
+    // Drops the queued entries of a job that has no items left.
+    void cancel(const std::shared_ptr<ParallelJob> &job) {
+        std::lock_guard<std::mutex> lock(mutex);
+        queue.erase(std::remove(queue.begin(), queue.end(), job), queue.end());
+    }
+
+private:
+    WorkerPool() : workers(0) {}
+
+    void run() {
+        for (;;) {
+            std::shared_ptr<ParallelJob> job;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                available.wait(lock, [this]() { return !queue.empty(); });
+                job = queue.front();
+                queue.pop_front();
+            }
+            job->work();
+        }
+    }
+
+    std::mutex mutex;
+    std::condition_variable available;
+    std::deque<std::shared_ptr<ParallelJob>> queue;
+    size_t workers;
+};
+
+// Calls fn(i) for every i in [0, n). fn must not throw.
+template <typename F>
+void parallel_for(const size_t n, size_t threads, F fn) {
+    threads = resolve_threads(threads, n);
+
+    if (threads == 1) {
+        for (size_t i = 0; i < n; i++) {
+            fn(i);
+        }
+        return;
+    }
+
+    std::shared_ptr<ParallelJob> job = std::make_shared<ParallelJob>(n, fn);
+    WorkerPool &pool = WorkerPool::instance();
+    pool.submit(job, threads - 1);
+    job->work();
+    pool.cancel(job);
+    job->wait();
+}
+
+};
+
+#endif
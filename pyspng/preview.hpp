@@ -0,0 +1,154 @@
+/*
+ * Reduced resolution previews of Adam7 interlaced PNGs.
+ *
+ * After pass k of Adam7 the pixels received so far form a regular
+ * grid over the whole image, so a preview can stop inflating as soon
+ * as pass k + 1 begins. Pass 1 is 1/64th of the pixels and roughly
+ * that fraction of the IDAT data.
+ *
+ * Passes are numbered 1 to 7 here, like in the PNG specification,
+ * while libspng numbers them from 0.
+ */
+
+#ifndef __PYSPNG_PREVIEW_HPP__
+#define __PYSPNG_PREVIEW_HPP__
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+#include "codec.hpp"
+
+namespace pyspng {
+
+// Spacing of the pixel grid that is complete after each pass.
+const uint8_t ADAM7_GRID_Y[7] = { 8, 8, 4, 4, 2, 2, 1 };
+const uint8_t ADAM7_GRID_X[7] = { 8, 4, 4, 2, 2, 1, 1 };
+
+// Decodes the pixels Adam7 passes 1 to max_pass carry.
+//
+// If fill is false the result is the grid itself, the image subsampled
+// by ADAM7_GRID_Y/X, e.g. ceil(h / 8) x ceil(w / 8) for pass 1.
+// Otherwise each grid pixel is repeated over the block it stands for
+// to produce a full size nearest neighbor upsampled image.
+//
+// Images that aren't interlaced give the same result, but have
+// to be inflated down to the last grid row to get there.
+inline DecodedImage decode_preview(DecodePlan &plan, const int max_pass, const bool fill) {
+    if (max_pass < 1 || max_pass > 7) {
+        throw std::invalid_argument("pyspng: max_pass must be between 1 and 7. Got: " + std::to_string(max_pass));
+    }
+
+    const int last_pass = max_pass - 1; // libspng numbering
+    const size_t sy = ADAM7_GRID_Y[last_pass];
+    const size_t sx = ADAM7_GRID_X[last_pass];
+
+    const size_t height = plan.ihdr.height;
+    const size_t width = plan.ihdr.width;
+    const size_t bpp = plan.channels * plan.sample_bytes;
+    const size_t row_bytes = plan.row_bytes();
+
+    const size_t grid_height = (height + sy - 1) / sy;
+    const size_t grid_width = (width + sx - 1) / sx;
+    const size_t grid_row_bytes = grid_width * bpp;
+
+    std::unique_ptr<uint8_t, void(*)(void*)> grid(
+        static_cast<uint8_t*>(malloc(grid_height * grid_row_bytes)), free
+    );
+    if (!grid) {
+        throw std::runtime_error("pyspng: unable to allocate " + std::to_string(grid_height * grid_row_bytes) + " bytes.");
+    }
+
+    int res;
+    spng_ctx *ctx = plan.ctx.get();
+    if ((res = spng_decode_image(ctx, NULL, 0, plan.render_fmt, plan.decode_flags | SPNG_DECODE_PROGRESSIVE)) != SPNG_OK) {
+        throw std::runtime_error("pyspng: could not decode image: " + std::string(spng_strerror(res)));
+    }
+
+    std::unique_ptr<uint8_t[]> row(new uint8_t[row_bytes]());
+    const bool interlaced = plan.ihdr.interlace_method != SPNG_INTERLACE_NONE;
+
+    // Row info describes the row the next call will decode.
+    struct spng_row_info row_info;
+    do {
+        if ((res = spng_get_row_info(ctx, &row_info)) != SPNG_OK) {
+            break;
+        }
+        if (interlaced && row_info.pass > last_pass) {
+            res = SPNG_EOI;
+            break;
+        }
+
+        res = spng_decode_row(ctx, row.get(), row_bytes);
+        if (res != SPNG_OK && res != SPNG_EOI) {
+            break;
+        }
+
+        const size_t y = row_info.row_num;
+        if (y % sy != 0) {
+            continue;
+        }
+
+        // every pixel of passes up to last_pass lies on the grid
+        size_t x0 = 0;
+        size_t dx = sx;
+        if (interlaced) {
+            x0 = ADAM7_X_START[row_info.pass];
+            dx = ADAM7_X_DELTA[row_info.pass];
+        }
+
+        uint8_t *dest = grid.get() + (y / sy) * grid_row_bytes;
+        for (size_t x = x0; x < width; x += dx) {
+            memcpy(dest + (x / sx) * bpp, row.get() + x * bpp, bpp);
+        }
+
+        // the remaining rows of a plain image are off the grid
+        if (!interlaced && y + sy >= height) {
+            res = SPNG_EOI;
+        }
+    } while (res == SPNG_OK);
+
+    if (res != SPNG_EOI) {
+        throw std::runtime_error("pyspng: could not decode image: " + std::string(spng_strerror(res)));
+    }
+
+    DecodedImage image;
+    image.channels = plan.channels;
+    image.sample_bytes = plan.sample_bytes;
+
+    if (!fill) {
+        image.data = grid.release();
+        image.height = grid_height;
+        image.width = grid_width;
+        return image;
+    }
+
+    uint8_t *full = static_cast<uint8_t*>(malloc(plan.out_size));
+    if (full == NULL) {
+        throw std::runtime_error("pyspng: unable to allocate " + std::to_string(plan.out_size) + " bytes.");
+    }
+
+    for (size_t y = 0; y < height; y++) {
+        uint8_t *dest = full + y * row_bytes;
+        if (y % sy != 0) {
+            memcpy(dest, dest - row_bytes, row_bytes);
+            continue;
+        }
+        const uint8_t *src = grid.get() + (y / sy) * grid_row_bytes;
+        for (size_t x = 0; x < width; x++) {
+            memcpy(dest + x * bpp, src + (x / sx) * bpp, bpp);
+        }
+    }
+
+    image.data = full;
+    image.height = height;
+    image.width = width;
+    return image;
+}
+
+};
+
+#endif
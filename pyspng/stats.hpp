@@ -0,0 +1,139 @@
+/*
+ * Opt-in per-call instrumentation (stats=True in Python).
+ *
+ * libspng adds the time it spends on chunks, zlib and filtering to
+ * the spng__stats attached to its context (see spng.h). Everything
+ * else is timed around the calls here, and whatever is left of the
+ * time spent inside the codec is reported as conversion. Without
+ * stats attached every hook costs a NULL check.
+ */
+
+#ifndef __PYSPNG_STATS_HPP__
+#define __PYSPNG_STATS_HPP__
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "spng.h"
+
+namespace pyspng {
+
+inline uint64_t clock_ns() {
+    return static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()
+        ).count()
+    );
+}
+
+// Number of scanlines in the IDAT stream of an image,
+// the rows of each non-empty Adam7 pass if interlaced.
+inline size_t num_scanlines(const size_t width, const size_t height, const bool interlaced) {
+    if (!interlaced) {
+        return height;
+    }
+
+    const size_t x_start[7] = { 0, 4, 0, 2, 0, 1, 0 };
+    const size_t y_start[7] = { 0, 0, 4, 0, 2, 0, 1 };
+    const size_t y_delta[7] = { 8, 8, 8, 4, 4, 2, 2 };
+
+    size_t scanlines = 0;
+    for (int pass = 0; pass < 7; pass++) {
+        if (width > x_start[pass] && height > y_start[pass]) {
+            scanlines += (height - y_start[pass] + y_delta[pass] - 1) / y_delta[pass];
+        }
+    }
+    return scanlines;
+}
+
+// Adds the stage times and counts of one spng__stats to another.
+inline void add_stats(struct spng__stats &into, const struct spng__stats &from) {
+    into.chunks_ns += from.chunks_ns;
+    into.zlib_ns += from.zlib_ns;
+    into.filter_ns += from.filter_ns;
+    into.idat_bytes += from.idat_bytes;
+    into.scanline_bytes += from.scanline_bytes;
+    into.scanlines += from.scanlines;
+    for (int i = 0; i < 5; i++) {
+        into.filter_counts[i] += from.filter_counts[i];
+    }
+}
+
+inline struct spng__stats new_spng_stats() {
+    struct spng__stats stats;
+    memset(&stats, 0, sizeof(stats));
+    stats.clock_ns = []() { return clock_ns(); };
+    return stats;
+}
+
+// Where the time of one decode or encode call went, in
+// nanoseconds. With the threaded strip encoder codec_ns and
+// the stage times are summed over threads.
+struct CallStats {
+    struct spng__stats spng;
+    std::vector<uint8_t> row_filters; // filter type of each scanline
+
+    uint64_t input_ns; // getting at the input
+    uint64_t header_ns; // signature and IHDR (decode)
+    uint64_t codec_ns; // inside libspng or the strip encoder
+    uint64_t alloc_ns; // creating the output object
+
+    uint64_t input_bytes;
+    uint64_t output_bytes;
+
+    CallStats()
+        : spng(new_spng_stats()), input_ns(0), header_ns(0),
+          codec_ns(0), alloc_ns(0), input_bytes(0), output_bytes(0) {}
+
+    // Room for the filter type of every scanline of the image.
+    void reserve_rows(const size_t width, const size_t height, const bool interlaced) {
+        row_filters.assign(num_scanlines(width, height, interlaced), 0);
+        spng.row_filters = row_filters.data();
+        spng.row_filters_size = row_filters.size();
+    }
+
+    void attach(spng_ctx *ctx) {
+        spng__set_stats(ctx, &spng);
+    }
+
+    // Drops the entries of scanlines that were never reached,
+    // e.g. below a region or after the last preview pass.
+    void finish() {
+        row_filters.resize(std::min(row_filters.size(), static_cast<size_t>(spng.scanlines)));
+    }
+
+    // Codec time not spent on chunks, zlib or filtering: pixel
+    // format conversion, byte swapping, (de)interlacing and copies.
+    uint64_t convert_ns() const {
+        const uint64_t staged = spng.chunks_ns + spng.zlib_ns + spng.filter_ns;
+        return codec_ns > staged ? codec_ns - staged : 0;
+    }
+};
+
+// Adds the time until it goes out of scope to *counter, unless NULL.
+class ScopedTimer {
+public:
+    explicit ScopedTimer(uint64_t *counter_)
+        : counter(counter_), start(counter_ ? clock_ns() : 0) {}
+
+    ~ScopedTimer() {
+        if (counter) {
+            *counter += clock_ns() - start;
+        }
+    }
+
+private:
+    ScopedTimer(const ScopedTimer &) = delete;
+    ScopedTimer &operator=(const ScopedTimer &) = delete;
+
+    uint64_t *counter;
+    uint64_t start;
+};
+
+};
+
+#endif
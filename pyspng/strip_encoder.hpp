@@ -0,0 +1,430 @@
+/*
+ * Multi-threaded encoder for a single large non-interlaced image.
+ *
+ * The image is cut into horizontal strips of whole rows. Each strip
+ * is filtered and deflated on its own thread as a raw deflate stream
+ * that ends in a sync flush (the last strip is finished instead), so
+ * the strips can simply be concatenated behind a zlib header. The
+ * Adler-32 checksums of the strips are combined into the trailer.
+ * Filtering of the first row of a strip still looks at the last row
+ * of the previous strip, which is available in the input image.
+ * This is the same technique pigz uses, minus dictionary priming,
+ * and the result is an ordinary PNG that any decoder can read.
+ */
+
+#ifndef __PYSPNG_STRIP_ENCODER_HPP__
+#define __PYSPNG_STRIP_ENCODER_HPP__
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "codec.hpp"
+#include "filters.hpp"
+#include "parallel.hpp"
+#include "stats.hpp"
+
+namespace pyspng {
+
+// Strips smaller than this lose too much compression to
+// the dictionary reset at every strip boundary.
+const size_t STRIP_MIN_BYTES = 1024 * 1024;
+
+// Largest IDAT chunk we emit.
+const size_t STRIP_IDAT_SIZE = 1024 * 1024;
+
+// From zlib's adler32_combine.
+inline uint32_t adler32_combine_(const uint32_t adler1, const uint32_t adler2, const uint64_t len2) {
+    const uint32_t BASE = 65521;
+
+    const uint32_t rem = static_cast<uint32_t>(len2 % BASE);
+    uint32_t sum1 = adler1 & 0xffff;
+    uint32_t sum2 = static_cast<uint32_t>((static_cast<uint64_t>(rem) * sum1) % BASE);
+    sum1 += (adler2 & 0xffff) + BASE - 1;
+    sum2 += ((adler1 >> 16) & 0xffff) + ((adler2 >> 16) & 0xffff) + BASE - rem;
+    if (sum1 >= BASE) sum1 -= BASE;
+    if (sum1 >= BASE) sum1 -= BASE;
+    if (sum2 >= (BASE << 1)) sum2 -= (BASE << 1);
+    if (sum2 >= BASE) sum2 -= BASE;
+    return sum1 | (sum2 << 16);
+}
+
+inline void write_u32_be(unsigned char *dest, const uint32_t x) {
+    dest[0] = (x >> 24) & 0xff;
+    dest[1] = (x >> 16) & 0xff;
+    dest[2] = (x >> 8) & 0xff;
+    dest[3] = x & 0xff;
+}
+
+struct DeflatedStrip {
+    std::vector<unsigned char> data;
+    uint32_t adler;
+    uint64_t raw_bytes;
+};
+
+// A raw deflate stream that is ended however the caller exits.
+struct DeflateStream {
+    z_stream zs;
+
+    DeflateStream(const EncodeOptions &options, const int strategy) {
+        memset(&zs, 0, sizeof(zs));
+        if (deflateInit2(
+            &zs, options.compress_level, Z_DEFLATED,
+            -options.window_bits, options.mem_level, strategy
+        ) != Z_OK) {
+            throw std::runtime_error("pyspng: unable to initialize deflate.");
+        }
+    }
+
+    ~DeflateStream() {
+        deflateEnd(&zs);
+    }
+
+    DeflateStream(const DeflateStream &) = delete;
+    DeflateStream &operator=(const DeflateStream &) = delete;
+};
+
+// stats, if not NULL, receives the filtering and deflate times and
+// the filter of each row, with row_filters[0] being row y0.
+inline void deflate_strip(
+    const ImageView &image,
+    const size_t y0, const size_t y1,
+    const EncodeOptions &options,
+    const bool last,
+    DeflatedStrip &strip,
+    struct spng__stats *stats = NULL
+) {
+    const size_t bpp = image.filter_bpp();
+    const size_t rowbytes = image.row_bytes();
+    const uint8_t *pixels = static_cast<const uint8_t*>(image.data);
+
+    // Match libspng: filtering is pointless without compression or
+    // on palette indices and packed rows, and Z_FILTERED only helps
+    // with filtered rows.
+    int filter_choice = options.filter_choice;
+    if (filter_choice < 0) {
+        const bool filterable = options.compress_level
+            && png_color_type(image) != SPNG_COLOR_TYPE_INDEXED
+            && image.bit_depth() >= 8;
+        filter_choice = filterable ? SPNG_FILTER_CHOICE_ALL : 0;
+    }
+    if (filter_choice == SPNG_FILTER_CHOICE_NONE) {
+        filter_choice = 0;
+    }
+    int strategy = options.strategy;
+    if (strategy < 0) {
+        strategy = filter_choice ? Z_FILTERED : Z_DEFAULT_STRATEGY;
+    }
+
+    std::vector<uint8_t> cur(rowbytes);
+    std::vector<uint8_t> prev(rowbytes, 0);
+    std::vector<uint8_t> filtered(rowbytes + 1);
+
+    if (y0 > 0) {
+        copy_row_to_bigendian(prev.data(), pixels + (y0 - 1) * rowbytes, rowbytes, image.sample_bytes);
+    }
+
+    DeflateStream stream(options, strategy);
+    z_stream &zs = stream.zs;
+
+    std::vector<unsigned char> &out = strip.data;
+    size_t used = 0;
+    out.resize(std::max(static_cast<size_t>(65536), rowbytes / 2));
+
+    int ret = Z_OK;
+    auto pump = [&](const int flush) {
+        do {
+            if (out.size() - used < 65536) {
+                out.resize(out.size() * 2);
+            }
+            zs.next_out = out.data() + used;
+            zs.avail_out = static_cast<unsigned int>(out.size() - used);
+            {
+                ScopedTimer timer(stats ? &stats->zlib_ns : NULL);
+                ret = deflate(&zs, flush);
+            }
+            used = out.size() - zs.avail_out;
+
+            if (ret == Z_STREAM_ERROR) {
+                throw std::runtime_error("pyspng: deflate failed.");
+            }
+        } while (
+            zs.avail_in > 0
+            || zs.avail_out == 0
+            || (flush == Z_FINISH && ret != Z_STREAM_END)
+        );
+    };
+
+    uint32_t adler = adler32(0, NULL, 0);
+    for (size_t y = y0; y < y1; y++) {
+        copy_row_to_bigendian(cur.data(), pixels + y * rowbytes, rowbytes, image.sample_bytes);
+
+        int filter;
+        {
+            ScopedTimer timer(stats ? &stats->filter_ns : NULL);
+            filter = filter_row(filtered.data() + 1, cur.data(), prev.data(), rowbytes, bpp, filter_choice);
+        }
+        filtered[0] = static_cast<uint8_t>(filter);
+
+        if (stats) {
+            if (y - y0 < stats->row_filters_size) {
+                stats->row_filters[y - y0] = static_cast<unsigned char>(filter);
+            }
+            stats->scanlines++;
+            stats->scanline_bytes += rowbytes + 1;
+            stats->filter_counts[filter]++;
+        }
+
+        adler = adler32(adler, filtered.data(), rowbytes + 1);
+
+        zs.next_in = filtered.data();
+        zs.avail_in = static_cast<unsigned int>(rowbytes + 1);
+        pump(Z_NO_FLUSH);
+
+        std::swap(cur, prev);
+    }
+
+    pump(last ? Z_FINISH : Z_SYNC_FLUSH);
+
+    out.resize(used);
+    strip.adler = adler;
+    strip.raw_bytes = static_cast<uint64_t>(y1 - y0) * (rowbytes + 1);
+}
+
+// Writes a PNG chunk piece by piece, computing the CRC on the way.
+class ChunkWriter {
+public:
+    ChunkWriter(ByteSink &sink_, const size_t length, const char type[4]) : sink(sink_) {
+        unsigned char header[8];
+        write_u32_be(header, static_cast<uint32_t>(length));
+        memcpy(header + 4, type, 4);
+        sink.write(header, 8);
+
+        // CRC covers the chunk type and data, not the length.
+        crc = crc32(0, NULL, 0);
+        crc = crc32(crc, header + 4, 4);
+    }
+
+    void write(const unsigned char *data, const size_t length) {
+        sink.write(data, length);
+        crc = crc32(crc, data, static_cast<unsigned int>(length));
+    }
+
+    void finish() {
+        unsigned char tail[4];
+        write_u32_be(tail, static_cast<uint32_t>(crc));
+        sink.write(tail, 4);
+    }
+
+private:
+    ByteSink &sink;
+    unsigned long crc;
+};
+
+// PLTE, and tRNS up to the last entry that isn't opaque.
+inline void write_palette(ByteSink &sink, const Palette &palette) {
+    unsigned char entries[256 * 3];
+    unsigned char alpha[256];
+    size_t n_alpha = 0;
+    for (size_t i = 0; i < palette.size; i++) {
+        memcpy(entries + i * 3, palette.rgba[i], 3);
+        alpha[i] = palette.rgba[i][3];
+        if (alpha[i] != 255) {
+            n_alpha = i + 1;
+        }
+    }
+
+    ChunkWriter plte_chunk(sink, palette.size * 3, "PLTE");
+    plte_chunk.write(entries, palette.size * 3);
+    plte_chunk.finish();
+
+    if (n_alpha > 0) {
+        ChunkWriter trns_chunk(sink, n_alpha, "tRNS");
+        trns_chunk.write(alpha, n_alpha);
+        trns_chunk.finish();
+    }
+}
+
+// Picks how many strips to cut the image into.
+inline size_t num_strips(const ImageView &image, const size_t threads) {
+    const size_t rowbytes = image.row_bytes() + 1;
+    const size_t raw_bytes = rowbytes * image.height;
+
+    size_t strips = resolve_threads(threads, image.height);
+    strips = std::min(strips, raw_bytes / STRIP_MIN_BYTES);
+    return std::max(strips, static_cast<size_t>(1));
+}
+
+// Encodes a non-interlaced PNG using up to threads threads.
+// threads == 0 means one per core.
+inline void encode_strips(
+    const ImageView &image,
+    const EncodeOptions &options,
+    const size_t threads,
+    ByteSink &sink,
+    CallStats *stats = NULL
+) {
+    options.validate();
+
+    // picked once so that every strip uses the same filter
+    EncodeOptions strip_options = options;
+    {
+        ScopedTimer timer(stats ? &stats->spng.filter_ns : NULL);
+        strip_options.filter_choice = resolve_filter_choice(image, options);
+    }
+
+    const uint8_t color_type = png_color_type(image);
+
+    const size_t strips = num_strips(image, threads);
+    const size_t rows_per_strip = (image.height + strips - 1) / strips;
+
+    std::vector<DeflatedStrip> deflated(strips);
+    std::vector<std::string> errors(strips);
+
+    // per strip so that threads don't share counters
+    std::vector<struct spng__stats> strip_stats;
+    std::vector<uint64_t> strip_ns;
+    if (stats) {
+        stats->reserve_rows(image.width, image.height, false);
+        strip_stats.assign(strips, new_spng_stats());
+        strip_ns.assign(strips, 0);
+    }
+
+    uint64_t parallel_ns = 0;
+    {
+        ScopedTimer timer(stats ? &parallel_ns : NULL);
+        parallel_for(strips, strips, [&](const size_t i) {
+            const size_t y0 = i * rows_per_strip;
+            const size_t y1 = std::min(y0 + rows_per_strip, image.height);
+
+            struct spng__stats *s = NULL;
+            if (stats) {
+                s = &strip_stats[i];
+                s->row_filters = stats->row_filters.data() + y0;
+                s->row_filters_size = y1 - y0;
+            }
+
+            try {
+                ScopedTimer timer(stats ? &strip_ns[i] : NULL);
+                deflate_strip(image, y0, y1, strip_options, (i == strips - 1), deflated[i], s);
+            }
+            catch (const std::exception &e) {
+                errors[i] = e.what();
+            }
+        });
+    }
+
+    for (size_t i = 0; i < strips; i++) {
+        if (!errors[i].empty()) {
+            throw std::runtime_error(errors[i]);
+        }
+    }
+
+    if (stats) {
+        // The caller times this whole call into codec_ns.
+        // Count the strips as the sum of their threads' time.
+        for (size_t i = 0; i < strips; i++) {
+            add_stats(stats->spng, strip_stats[i]);
+            stats->codec_ns += strip_ns[i];
+        }
+        stats->codec_ns -= parallel_ns;
+    }
+
+    // the rest is writing chunks
+    ScopedTimer timer(stats ? &stats->spng.chunks_ns : NULL);
+
+    // zlib header: deflate with the window size, FLEVEL from the
+    // compression level, and FCHECK making it a multiple of 31.
+    const int compress_level = options.compress_level;
+    unsigned char zlib_header[2];
+    zlib_header[0] = static_cast<unsigned char>(((options.window_bits - 8) << 4) | Z_DEFLATED);
+    unsigned int flevel = 2;
+    if (compress_level < 2 || options.strategy >= Z_HUFFMAN_ONLY) flevel = 0;
+    else if (compress_level < 6) flevel = 1;
+    else if (compress_level > 6) flevel = 3;
+    zlib_header[1] = static_cast<unsigned char>(flevel << 6);
+    zlib_header[1] += 31 - ((zlib_header[0] << 8) + zlib_header[1]) % 31;
+
+    uint32_t adler = deflated[0].adler;
+    for (size_t i = 1; i < strips; i++) {
+        adler = adler32_combine_(adler, deflated[i].adler, deflated[i].raw_bytes);
+    }
+    unsigned char zlib_trailer[4];
+    write_u32_be(zlib_trailer, adler);
+
+    std::vector<std::pair<const unsigned char*, size_t>> segments;
+    segments.push_back(std::make_pair(zlib_header, 2));
+    size_t idat_bytes = 6;
+    for (size_t i = 0; i < strips; i++) {
+        segments.push_back(std::make_pair(deflated[i].data.data(), deflated[i].data.size()));
+        idat_bytes += deflated[i].data.size();
+    }
+    segments.push_back(std::make_pair(zlib_trailer, 4));
+
+    if (stats) {
+        stats->spng.idat_bytes += idat_bytes;
+    }
+
+    const unsigned char signature[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+    sink.write(signature, 8);
+
+    unsigned char ihdr[13];
+    write_u32_be(ihdr, static_cast<uint32_t>(image.width));
+    write_u32_be(ihdr + 4, static_cast<uint32_t>(image.height));
+    ihdr[8] = static_cast<unsigned char>(image.bit_depth());
+    ihdr[9] = color_type;
+    ihdr[10] = 0; // compression method
+    ihdr[11] = 0; // filter method
+    ihdr[12] = SPNG_INTERLACE_NONE;
+
+    ChunkWriter ihdr_chunk(sink, 13, "IHDR");
+    ihdr_chunk.write(ihdr, 13);
+    ihdr_chunk.finish();
+
+    if (image.palette) {
+        write_palette(sink, *image.palette);
+    }
+
+    size_t seg = 0;
+    size_t seg_offset = 0;
+    size_t remaining = idat_bytes;
+    while (remaining > 0) {
+        const size_t chunk_len = std::min(remaining, STRIP_IDAT_SIZE);
+        ChunkWriter idat_chunk(sink, chunk_len, "IDAT");
+
+        size_t needed = chunk_len;
+        while (needed > 0) {
+            const size_t take = std::min(needed, segments[seg].second - seg_offset);
+            idat_chunk.write(segments[seg].first + seg_offset, take);
+            needed -= take;
+            seg_offset += take;
+            if (seg_offset == segments[seg].second) {
+                seg++;
+                seg_offset = 0;
+            }
+        }
+
+        idat_chunk.finish();
+        remaining -= chunk_len;
+    }
+
+    ChunkWriter iend_chunk(sink, 0, "IEND");
+    iend_chunk.finish();
+}
+
+inline std::string encode_strips(
+    const ImageView &image,
+    const EncodeOptions &options,
+    const size_t threads
+) {
+    PngSink sink;
+    encode_strips(image, options, threads, sink);
+    return sink.spill;
+}
+
+};
+
+#endif
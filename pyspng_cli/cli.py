@@ -30,7 +30,7 @@ def main(compress, header, source, level, progressive, interlaced):
 	for i in range(len(source)):
 		if source[i] == "-":
 			source = source[:i] + sys.stdin.readlines() + source[i+1:]
-	
+
 	for src in source:
 		if header:
 			print_header(src)
@@ -56,24 +56,19 @@ def print_header(src):
 	print()
 
 def decompress_file(src):
-	try:
-		with open(src, "rb") as f:
-			binary = f.read()
-	except FileNotFoundError:
+	if not os.path.exists(src):
 		print(f"pyspng: File \"{src}\" does not exist.")
 		return
 
 	try:
-		data = pyspng.load(binary)
+		data = pyspng.load_file(src)
 	except:
 		print(f"pyspng: {src} could not be decoded.")
 		return
 
-	del binary
-
 	dest = src.replace(".png", "")
 	_, ext = os.path.splitext(dest)
-	
+
 	if ext != ".npy":
 		dest += ".npy"
 
@@ -91,7 +86,7 @@ def decompress_file(src):
 
 def compress_file(src, level, progressive, interlaced):
 	try:
-		data = np.load(src)
+		data = np.load(src, mmap_mode="r")
 	except ValueError:
 		print(f"pyspng: {src} is not a numpy file.")
 		return
@@ -106,14 +101,10 @@ def compress_file(src, level, progressive, interlaced):
 	else:
 		mode = pyspng.ProgressiveMode.NONE
 
-	binary = pyspng.encode(data, progressive=mode, compress_level=level)
-	del data
-
 	dest = src.replace(".npy", "")
 	dest = f"{dest}.png"
-	with open(dest, "wb") as f:
-		f.write(binary)
-	del binary
+	pyspng.save_file(dest, data, progressive=mode, compress_level=level)
+	del data
 
 	try:
 		stat = os.stat(dest)
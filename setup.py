@@ -17,40 +17,78 @@ vendor_dir = "./vendor"
 spng_dir = f'{vendor_dir}/libspng-0.7.2'
 miniz_dir = f'{vendor_dir}/miniz-2.2.0'
 
+# Deflate/inflate backend, chosen at build time:
+#   miniz: the vendored miniz (default), no dependencies.
+#   zlib: links zlib or a zlib compatible drop-in such as zlib-ng
+#     built with ZLIB_COMPAT, which has SIMD inflate, CRC-32 and
+#     Adler-32. Set PYSPNG_ZLIB_DIR to its install prefix if it
+#     isn't on the compiler's default paths.
+deflate_backend = os.environ.get("PYSPNG_DEFLATE", "miniz")
+if deflate_backend not in ("miniz", "zlib"):
+  raise ValueError(f"PYSPNG_DEFLATE must be miniz or zlib. Got: {deflate_backend}")
+
+zlib_dir = os.environ.get("PYSPNG_ZLIB_DIR")
+zlib_include_dirs = [ os.path.join(zlib_dir, "include") ] if zlib_dir else []
+zlib_library_dirs = [ os.path.join(zlib_dir, "lib") ] if zlib_dir else []
+zlib_libraries = [ "zlib" if sys.platform == 'win32' else "z" ]
+
 extra_compile_args = []
+extra_link_args = []
 if sys.platform == 'win32':
   extra_compile_args += [ '/O2' ] # MSVC is C++11 by default
 else:
   extra_compile_args += [
-    '-std=c++11', '-O3',
+    '-std=c++11', '-O3', '-pthread',
   ]
+  extra_link_args += [ '-pthread' ]
 
 # MacOS doesn't like compiling C and C++ files together, so use
 # make to build a staticly linked libspng.a library.
 if sys.platform == 'darwin':
   extra_compile_args += [ '-stdlib=libc++' ]
-  subprocess.run("make", cwd=vendor_dir)
+  subprocess.run([ "make", f"DEFLATE={deflate_backend}" ], cwd=vendor_dir)
+  define_macros = [('VERSION_INFO', __version__)]
+  link_args = ['-lspng',]
+  if deflate_backend == "miniz":
+    define_macros += [('SPNG_USE_MINIZ', 1)]
+  else:
+    link_args += [ f"-L{d}" for d in zlib_library_dirs ] + [ '-lz' ]
   ext_modules = [
     Extension("_pyspng_c",
         ["pyspng/main.cpp",],
-        include_dirs=[ spng_dir, pybind11.get_include() ],
-        extra_link_args=['-lspng',],
+        include_dirs=[ spng_dir, miniz_dir, pybind11.get_include() ] + zlib_include_dirs,
+        extra_link_args=link_args,
         library_dirs=[ vendor_dir ],
         # Example: passing in the version to the compiled code
-        define_macros = [('VERSION_INFO', __version__)],
+        define_macros = define_macros,
         language="c++",
         extra_compile_args=[ "-std=c++14", "-O3" ],
     ),
   ]
 else:
-    extra_compile_args += [ "-DMINIZ_NO_STDIO=1", "-DSPNG_USE_MINIZ=1" ]
+    sources = [ "pyspng/main.cpp", f"{spng_dir}/spng.c" ]
+    include_dirs = [ spng_dir, pybind11.get_include() ]
+    libraries = []
+    library_dirs = []
+    if deflate_backend == "miniz":
+      extra_compile_args += [ "-DMINIZ_NO_STDIO=1", "-DSPNG_USE_MINIZ=1" ]
+      sources += [ f"{miniz_dir}/miniz.c" ]
+      include_dirs += [ miniz_dir ]
+    else:
+      include_dirs += zlib_include_dirs
+      library_dirs += zlib_library_dirs
+      libraries += zlib_libraries
+
     ext_modules = [
         Extension("_pyspng_c",
-            [ "pyspng/main.cpp", f"{miniz_dir}/miniz.c", f"{spng_dir}/spng.c" ],
-            include_dirs=[ spng_dir, miniz_dir, pybind11.get_include() ],
+            sources,
+            include_dirs=include_dirs,
+            libraries=libraries,
+            library_dirs=library_dirs,
             # Example: passing in the version to the compiled code
             define_macros = [('VERSION_INFO', __version__)],
             extra_compile_args=extra_compile_args,
+            extra_link_args=extra_link_args,
         ),
     ]
 
@@ -0,0 +1,384 @@
+/*
+ * Microbenchmark of the native encode/decode paths behind the Python
+ * bindings, without the interpreter, numpy or the GIL in the way.
+ *
+ * Each case calls the same pyspng:: functions main.cpp does and the
+ * results are written in the JSON format of tests/benchmark.py, so
+ * two runs can be compared with
+ *
+ *     python tests/benchmark.py compare base.json new.json
+ *
+ * Build with make -C tests bench_codec, then run e.g.
+ *
+ *     tests/bench_codec --sizes 256,2048 --levels 1,6 --json new.json
+ *
+ * Peak RSS is that of the whole run up to the end of each case.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <functional>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifndef _WIN32
+    #include <sys/resource.h>
+#endif
+
+#include "codec.hpp"
+#include "parallel.hpp"
+#include "preview.hpp"
+#include "strip_encoder.hpp"
+
+using namespace pyspng;
+
+struct Format {
+    const char *name;
+    size_t channels;
+    size_t sample_bytes;
+};
+
+const Format FORMATS[] = {
+    { "G8", 1, 1 }, { "GA8", 2, 1 }, { "RGB8", 3, 1 }, { "RGBA8", 4, 1 },
+    { "G16", 1, 2 }, { "GA16", 2, 2 }, { "RGB16", 3, 2 }, { "RGBA16", 4, 2 },
+};
+
+// Batch operations only run on images up to this many pixels.
+const size_t BATCH_PIXELS = 1024 * 1024;
+const size_t BATCH = 8;
+
+struct Settings {
+    std::vector<size_t> sizes;
+    std::vector<int> levels;
+    std::vector<size_t> threads; // of the batch cases, 0 is one per core
+    size_t min_calls;
+    double min_seconds;
+    std::string filter;
+    std::string json;
+
+    Settings() : sizes({ 64, 512, 2048 }), levels({ 1, 6 }), threads({ 1, 0 }), min_calls(5), min_seconds(0.25) {}
+};
+
+struct Result {
+    std::string name;
+    std::string op;
+    std::string fmt;
+    size_t size;
+    int level;
+    bool interlaced;
+    size_t threads;
+    size_t raw_bytes;
+    size_t png_bytes;
+    std::vector<double> latencies; // ms
+    double peak_rss_mb;
+};
+
+double peak_rss_mb() {
+#ifdef _WIN32
+    return -1;
+#else
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    #ifdef __APPLE__
+        return usage.ru_maxrss / (1024.0 * 1024.0);
+    #else
+        return usage.ru_maxrss / 1024.0;
+    #endif
+#endif
+}
+
+// Smooth structure plus a little noise, like photographic
+// or microscopy data.
+std::vector<uint8_t> make_image(const size_t size, const Format &fmt) {
+    const size_t values = size * size * fmt.channels;
+    std::vector<uint8_t> pixels(values * fmt.sample_bytes);
+    const double maxval = fmt.sample_bytes == 2 ? 65535 : 255;
+
+    uint32_t rng = 12345;
+    for (size_t i = 0; i < values; i++) {
+        const size_t c = i % fmt.channels;
+        const size_t x = (i / fmt.channels) % size;
+        const size_t y = i / fmt.channels / size;
+        rng = rng * 1103515245u + 12345u;
+
+        double v = 0.5 + 0.35 * sin(9.0 * (c % 2 ? y : x) / size + c);
+        v += ((rng >> 16) % 1000) / 100000.0;
+        v = std::min(std::max(v, 0.0), 1.0) * maxval;
+
+        if (fmt.sample_bytes == 2) {
+            const uint16_t s = static_cast<uint16_t>(v);
+            memcpy(&pixels[i * 2], &s, 2);
+        }
+        else {
+            pixels[i] = static_cast<uint8_t>(v);
+        }
+    }
+    return pixels;
+}
+
+std::string encode_image(const ImageView &view, const int progressive, const int level, const size_t threads) {
+    std::string out(max_encoded_size(view), '\0');
+    PngSink sink(&out[0], out.size());
+    if (progressive != PROGRESSIVE_MODE_INTERLACED && num_strips(view, threads) > 1) {
+        encode_strips(view, level, threads, sink);
+    }
+    else {
+        encode(view, progressive, level, sink);
+    }
+    out.resize(sink.size);
+    return out + sink.spill;
+}
+
+std::vector<double> time_calls(const std::function<void()> &fn, const Settings &settings) {
+    typedef std::chrono::steady_clock clock;
+
+    fn(); // warmup
+    std::vector<double> latencies;
+    const clock::time_point start = clock::now();
+    while (latencies.size() < 1000) {
+        const clock::time_point t0 = clock::now();
+        fn();
+        const clock::time_point t1 = clock::now();
+        latencies.push_back(std::chrono::duration<double, std::milli>(t1 - t0).count());
+
+        const double elapsed = std::chrono::duration<double>(t1 - start).count();
+        if (latencies.size() >= settings.min_calls && elapsed >= settings.min_seconds) {
+            break;
+        }
+    }
+    return latencies;
+}
+
+// Linear interpolation between closest ranks, like numpy.percentile.
+double percentile(std::vector<double> values, const double p) {
+    std::sort(values.begin(), values.end());
+    const double rank = p / 100 * (values.size() - 1);
+    const size_t lo = static_cast<size_t>(rank);
+    const size_t hi = std::min(lo + 1, values.size() - 1);
+    return values[lo] + (rank - lo) * (values[hi] - values[lo]);
+}
+
+class Runner {
+public:
+    explicit Runner(const Settings &settings_) : settings(settings_) {}
+
+    void run(
+        const std::string &op, const Format &fmt, const size_t size,
+        const int level, const bool interlaced, const size_t threads,
+        const size_t raw_bytes, const size_t png_bytes,
+        const std::function<void()> &fn
+    ) {
+        Result r;
+        std::ostringstream name;
+        name << op << "/" << fmt.name << "/photo/" << size << "px/level" << level
+             << "/" << (interlaced ? "adam7" : "plain") << "/threads" << threads;
+        if (op.find("_many") != std::string::npos) {
+            name << "/batch" << BATCH;
+        }
+        r.name = name.str();
+        if (!settings.filter.empty() && r.name.find(settings.filter) == std::string::npos) {
+            return;
+        }
+
+        r.op = op;
+        r.fmt = fmt.name;
+        r.size = size;
+        r.level = level;
+        r.interlaced = interlaced;
+        r.threads = threads;
+        r.raw_bytes = raw_bytes;
+        r.png_bytes = png_bytes;
+        r.latencies = time_calls(fn, settings);
+        r.peak_rss_mb = peak_rss_mb();
+
+        const double p50 = percentile(r.latencies, 50);
+        fprintf(stderr, "%s  p50 %.3f ms  p99 %.3f ms  %.1f MB/s  %zu bytes\n",
+            r.name.c_str(), p50, percentile(r.latencies, 99), raw_bytes / 1e6 / (p50 / 1e3), png_bytes);
+
+        results.push_back(r);
+    }
+
+    void write_json(FILE *out) const {
+        time_t now = time(NULL);
+        char timestamp[32];
+        strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%S", localtime(&now));
+
+        fprintf(out, "{\n  \"meta\": {\n");
+        fprintf(out, "    \"pyspng\": \"bench_codec\",\n");
+        fprintf(out, "    \"deflate_backend\": \"%s\",\n", deflate_backend().c_str());
+        fprintf(out, "    \"cpu_count\": %u,\n", std::thread::hardware_concurrency());
+        fprintf(out, "    \"time\": \"%s\"\n  },\n", timestamp);
+        fprintf(out, "  \"corpus\": \"bench_codec\",\n  \"results\": [");
+
+        for (size_t i = 0; i < results.size(); i++) {
+            const Result &r = results[i];
+            const double p50 = percentile(r.latencies, 50);
+            fprintf(out, "%s\n    {\n", i ? "," : "");
+            fprintf(out, "      \"name\": \"%s\",\n", r.name.c_str());
+            fprintf(out, "      \"op\": \"%s\",\n", r.op.c_str());
+            fprintf(out, "      \"fmt\": \"%s\",\n", r.fmt.c_str());
+            fprintf(out, "      \"content\": \"photo\",\n");
+            fprintf(out, "      \"size\": %zu,\n", r.size);
+            fprintf(out, "      \"level\": %d,\n", r.level);
+            fprintf(out, "      \"interlaced\": %s,\n", r.interlaced ? "true" : "false");
+            fprintf(out, "      \"threads\": %zu,\n", r.threads);
+            fprintf(out, "      \"raw_bytes\": %zu,\n", r.raw_bytes);
+            fprintf(out, "      \"png_bytes\": %zu,\n", r.png_bytes);
+            fprintf(out, "      \"calls\": %zu,\n", r.latencies.size());
+            fprintf(out, "      \"min_ms\": %.6f,\n", *std::min_element(r.latencies.begin(), r.latencies.end()));
+            fprintf(out, "      \"p50_ms\": %.6f,\n", p50);
+            fprintf(out, "      \"p90_ms\": %.6f,\n", percentile(r.latencies, 90));
+            fprintf(out, "      \"p99_ms\": %.6f,\n", percentile(r.latencies, 99));
+            fprintf(out, "      \"mb_per_s\": %.6f,\n", r.raw_bytes / 1e6 / (p50 / 1e3));
+            if (r.peak_rss_mb < 0) {
+                fprintf(out, "      \"peak_rss_mb\": null\n    }");
+            }
+            else {
+                fprintf(out, "      \"peak_rss_mb\": %.3f\n    }", r.peak_rss_mb);
+            }
+        }
+        fprintf(out, "\n  ]\n}\n");
+    }
+
+private:
+    const Settings &settings;
+    std::vector<Result> results;
+};
+
+void bench_format(
+    Runner &runner, const Format &fmt, const size_t size, const int level,
+    const std::vector<size_t> &batch_threads
+) {
+    const std::vector<uint8_t> pixels = make_image(size, fmt);
+    const ImageView view = { pixels.data(), size, size, fmt.channels, fmt.sample_bytes, 0, NULL };
+    const size_t raw_bytes = view.nbytes();
+
+    for (int interlaced = 0; interlaced < 2; interlaced++) {
+        const int progressive = interlaced ? PROGRESSIVE_MODE_INTERLACED : PROGRESSIVE_MODE_NONE;
+        const std::string png = encode_image(view, progressive, level, 1);
+
+        // spng_encode_image
+        runner.run("encode", fmt, size, level, interlaced, 1, raw_bytes, png.size(), [&]() {
+            encode_image(view, progressive, level, 1);
+        });
+        if (!interlaced) {
+            runner.run("encode", fmt, size, level, interlaced, 0, raw_bytes, png.size(), [&]() {
+                encode_image(view, progressive, level, 0);
+            });
+        }
+
+        // spng_decode_image_bytes
+        runner.run("decode", fmt, size, level, interlaced, 1, raw_bytes, png.size(), [&]() {
+            DecodedImage image = decode(png.data(), png.size(), 0);
+            free(image.data);
+        });
+
+        // spng_decode_image_into with a preallocated array
+        std::vector<uint8_t> out(raw_bytes);
+        runner.run("decode_into", fmt, size, level, interlaced, 1, raw_bytes, png.size(), [&]() {
+            DecodePlan plan = plan_decode(png.data(), png.size(), 0);
+            const ptrdiff_t cs = plan.sample_bytes;
+            OutputView view = { out.data(), {
+                static_cast<ptrdiff_t>(plan.row_bytes()), static_cast<ptrdiff_t>(plan.channels) * cs, cs
+            } };
+            decode_into(plan, view);
+        });
+
+        // region=(0, h/4, w/4, w/2)
+        runner.run("decode_region", fmt, size, level, interlaced, 1, raw_bytes / 16, png.size(), [&]() {
+            Region region = { 0, std::max(size / 4, size_t(1)), size / 4, std::max(size / 2, size / 4 + 1) };
+            DecodedImage image = decode_region(png.data(), png.size(), 0, region);
+            free(image.data);
+        });
+
+        if (interlaced) {
+            // max_pass=1
+            runner.run("decode_preview", fmt, size, level, interlaced, 1, raw_bytes / 64, png.size(), [&]() {
+                DecodePlan plan = plan_decode(png.data(), png.size(), 0);
+                DecodedImage image = decode_preview(plan, 1, false);
+                free(image.data);
+            });
+        }
+
+        if (size * size > BATCH_PIXELS) {
+            continue;
+        }
+
+        // spng_decode_many and spng_encode_many
+        for (size_t threads : batch_threads) {
+            runner.run("decode_many", fmt, size, level, interlaced, threads, raw_bytes * BATCH, png.size(), [&]() {
+                parallel_for(BATCH, threads, [&](const size_t) {
+                    DecodedImage image = decode(png.data(), png.size(), 0);
+                    free(image.data);
+                });
+            });
+            runner.run("encode_many", fmt, size, level, interlaced, threads, raw_bytes * BATCH, png.size(), [&]() {
+                parallel_for(BATCH, threads, [&](const size_t) {
+                    encode_image(view, progressive, level, 1);
+                });
+            });
+        }
+    }
+}
+
+template <typename T>
+std::vector<T> parse_list(const char *arg) {
+    std::vector<T> values;
+    std::stringstream ss(arg);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        values.push_back(static_cast<T>(std::stoll(item)));
+    }
+    return values;
+}
+
+int main(int argc, char **argv) {
+    Settings settings;
+    for (int i = 1; i < argc; i++) {
+        const std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            fprintf(stderr, "usage: bench_codec [--sizes 64,512] [--levels 1,6] [--min-calls N] "
+                            "[--threads 1,0] [--min-seconds S] [--filter TEXT] [--json FILE]\n");
+            return 2;
+        }
+        const char *value = argv[++i];
+        if (arg == "--sizes") settings.sizes = parse_list<size_t>(value);
+        else if (arg == "--levels") settings.levels = parse_list<int>(value);
+        else if (arg == "--threads") settings.threads = parse_list<size_t>(value);
+        else if (arg == "--min-calls") settings.min_calls = std::stoul(value);
+        else if (arg == "--min-seconds") settings.min_seconds = std::stod(value);
+        else if (arg == "--filter") settings.filter = value;
+        else if (arg == "--json") settings.json = value;
+        else {
+            fprintf(stderr, "bench_codec: unknown option %s\n", arg.c_str());
+            return 2;
+        }
+    }
+
+    Runner runner(settings);
+    for (size_t size : settings.sizes) {
+        for (const Format &fmt : FORMATS) {
+            for (int level : settings.levels) {
+                bench_format(runner, fmt, size, level, settings.threads);
+            }
+        }
+    }
+
+    FILE *out = settings.json.empty() ? stdout : fopen(settings.json.c_str(), "w");
+    if (out == NULL) {
+        fprintf(stderr, "bench_codec: could not open %s\n", settings.json.c_str());
+        return 1;
+    }
+    runner.write_json(out);
+    if (out != stdout) {
+        fclose(out);
+    }
+    return 0;
+}
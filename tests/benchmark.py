@@ -0,0 +1,340 @@
+"""
+Benchmark suite for pyspng.
+
+Runs encode and decode over a generated corpus of images and writes
+the results as JSON, or compares two such JSON files and fails if
+anything got slower or bigger than a threshold allows.
+
+    python tests/benchmark.py run --corpus quick --json new.json
+    python tests/benchmark.py compare base.json new.json --threshold 0.1
+
+Corpora:
+    quick: a few formats at 64 and 512 px, enough to catch gross regressions.
+    standard: every format, 64 to 4096 px, compress levels 0, 1, 6 and 9.
+    full: standard plus compress levels 0-9 and 16384 px 8-bit images
+        (needs several GB of memory and a while to run).
+
+Each case runs in a fresh process (unless --no-isolate) so that its
+peak RSS is its own. Times are per call latencies measured with
+time.perf_counter after one warmup call. The C++ microbenchmark
+in bench_codec.cpp writes the same JSON format.
+"""
+
+import argparse
+import json
+import multiprocessing
+import os
+import platform
+import sys
+import time
+
+import numpy as np
+
+import pyspng
+
+FORMATS = {
+    # name: (channels, dtype)
+    "G8": (1, np.uint8),
+    "GA8": (2, np.uint8),
+    "RGB8": (3, np.uint8),
+    "RGBA8": (4, np.uint8),
+    "G16": (1, np.uint16),
+    "GA16": (2, np.uint16),
+    "RGB16": (3, np.uint16),
+    "RGBA16": (4, np.uint16),
+    "P8": (1, np.uint8), # palette, decoded to RGB8
+}
+
+CORPORA = {
+    "quick": dict(
+        formats=[ "G8", "RGB8", "G16", "RGBA16", "P8" ],
+        sizes=[ 64, 512 ],
+        levels=[ 1, 6 ],
+        contents=[ "photo" ],
+        batch=8,
+    ),
+    "standard": dict(
+        formats=list(FORMATS),
+        sizes=[ 64, 256, 1024, 4096 ],
+        levels=[ 0, 1, 6, 9 ],
+        contents=[ "noise", "gradient", "photo" ],
+        batch=8,
+    ),
+    "full": dict(
+        formats=list(FORMATS),
+        sizes=[ 64, 256, 1024, 4096, 16384 ],
+        levels=list(range(10)),
+        contents=[ "noise", "gradient", "photo" ],
+        batch=8,
+    ),
+}
+
+# Above this many pixels only 8-bit gray and RGB are generated.
+LARGE_PIXELS = 4096 * 4096
+
+# Batch operations only run on images up to this many pixels.
+BATCH_PIXELS = 1024 * 1024
+
+def make_image(fmt, content, size, seed=0):
+    channels, dtype = FORMATS[fmt]
+    rng = np.random.default_rng(seed)
+    maxval = 255 if fmt == "P8" else np.iinfo(dtype).max
+    shape = (size, size, channels)
+
+    if content == "noise":
+        return rng.integers(0, maxval, size=shape, dtype=dtype, endpoint=True)
+
+    y, x = np.mgrid[:size, :size].astype(np.float32) / size
+    planes = [ x, y, (x + y) / 2, 1 - x ][:channels]
+    img = np.stack(planes, axis=2)
+    if content == "photo":
+        # smooth structure plus sensor-like noise
+        img = 0.5 + 0.35 * np.sin(img * 9 + np.arange(channels))
+        img += rng.normal(0, 0.01, size=shape).astype(np.float32)
+    return (np.clip(img, 0, 1) * maxval).astype(dtype)
+
+def cases(corpus, threads_list):
+    spec = CORPORA[corpus]
+    for size in spec["sizes"]:
+        for fmt in spec["formats"]:
+            if size * size > LARGE_PIXELS and fmt not in ("G8", "RGB8"):
+                continue
+            for content in spec["contents"]:
+                for level in spec["levels"]:
+                    for interlaced in [ False, True ]:
+                        for threads in threads_list:
+                            case = dict(
+                                fmt=fmt, content=content, size=size,
+                                level=level, interlaced=interlaced, threads=threads,
+                            )
+                            # single image decoding has no threads option
+                            if threads == threads_list[0]:
+                                yield dict(case, op="decode", threads=1)
+                            yield dict(case, op="encode")
+                            if size * size <= BATCH_PIXELS:
+                                yield dict(case, op="decode_many", batch=spec["batch"])
+                                yield dict(case, op="encode_many", batch=spec["batch"])
+
+def case_name(case):
+    name = "{op}/{fmt}/{content}/{size}px/level{level}/{layout}/threads{threads}".format(
+        layout=("adam7" if case["interlaced"] else "plain"), **case
+    )
+    if "batch" in case:
+        name += "/batch{}".format(case["batch"])
+    return name
+
+def peak_rss_mb():
+    try:
+        import resource
+    except ImportError: # Windows
+        return None
+    rss = resource.getrusage(resource.RUSAGE_SELF).ru_maxrss
+    # kilobytes on Linux, bytes on MacOS
+    return rss / (1024 * 1024 if sys.platform == "darwin" else 1024)
+
+def time_calls(fn, min_calls, min_seconds, max_calls=1000):
+    fn() # warmup
+    latencies = []
+    start = time.perf_counter()
+    while len(latencies) < max_calls:
+        t0 = time.perf_counter()
+        fn()
+        latencies.append(time.perf_counter() - t0)
+        if len(latencies) >= min_calls and time.perf_counter() - start >= min_seconds:
+            break
+    return np.array(latencies) * 1e3
+
+def run_case(case, min_calls, min_seconds):
+    img = make_image(case["fmt"], case["content"], case["size"])
+    progressive = pyspng.ProgressiveMode.INTERLACED if case["interlaced"] else pyspng.ProgressiveMode.NONE
+    threads = case["threads"]
+    options = dict(progressive=progressive, compress_level=case["level"])
+
+    if case["fmt"] == "P8":
+        # gray levels as RGB, which reduce=True turns back into indices
+        img = np.repeat(img, 3, axis=2)
+        options["reduce"] = True
+
+    png = pyspng.encode(img, threads=threads, **options)
+
+    op = case["op"]
+    raw_bytes = img.nbytes
+    if op == "decode":
+        fn = lambda: pyspng.load(png)
+        raw_bytes = pyspng.load(png).nbytes
+    elif op == "encode":
+        fn = lambda: pyspng.encode(img, threads=threads, **options)
+    elif op == "decode_many":
+        pngs = [ png ] * case["batch"]
+        fn = lambda: pyspng.load_many(pngs, threads=threads)
+        raw_bytes *= case["batch"]
+    elif op == "encode_many":
+        imgs = [ img ] * case["batch"]
+        fn = lambda: pyspng.encode_many(imgs, threads=threads, **options)
+        raw_bytes *= case["batch"]
+    else:
+        raise ValueError(f"Unknown op: {op}")
+
+    latencies = time_calls(fn, min_calls, min_seconds)
+    p50, p90, p99 = np.percentile(latencies, [50, 90, 99])
+
+    return dict(
+        name=case_name(case),
+        **case,
+        raw_bytes=raw_bytes,
+        png_bytes=len(png),
+        calls=len(latencies),
+        min_ms=float(latencies.min()),
+        p50_ms=float(p50),
+        p90_ms=float(p90),
+        p99_ms=float(p99),
+        mb_per_s=float(raw_bytes / 1e6 / (p50 / 1e3)),
+        peak_rss_mb=peak_rss_mb(),
+    )
+
+def _run_case_child(queue, case, min_calls, min_seconds):
+    try:
+        queue.put(run_case(case, min_calls, min_seconds))
+    except Exception as e:
+        queue.put(dict(name=case_name(case), **case, error=repr(e)))
+
+def run_isolated(case, min_calls, min_seconds):
+    ctx = multiprocessing.get_context("spawn")
+    queue = ctx.Queue()
+    proc = ctx.Process(target=_run_case_child, args=(queue, case, min_calls, min_seconds))
+    proc.start()
+    result = queue.get()
+    proc.join()
+    return result
+
+def metadata():
+    return dict(
+        pyspng=pyspng.__version__,
+        deflate_backend=pyspng.deflate_backend,
+        python=platform.python_version(),
+        numpy=np.__version__,
+        platform=platform.platform(),
+        machine=platform.machine(),
+        cpu_count=os.cpu_count(),
+        time=time.strftime("%Y-%m-%dT%H:%M:%S"),
+    )
+
+def run(args):
+    threads_list = [ int(t) for t in args.threads.split(",") ]
+    todo = list(cases(args.corpus, threads_list))
+    if args.filter:
+        todo = [ case for case in todo if args.filter in case_name(case) ]
+
+    results = []
+    for i, case in enumerate(todo):
+        if args.isolate:
+            result = run_isolated(case, args.min_calls, args.min_seconds)
+        else:
+            result = run_case(case, args.min_calls, args.min_seconds)
+        results.append(result)
+
+        if "error" in result:
+            print(f"[{i+1}/{len(todo)}] {result['name']}  ERROR {result['error']}", file=sys.stderr)
+        else:
+            print(
+                f"[{i+1}/{len(todo)}] {result['name']}  "
+                f"p50 {result['p50_ms']:.3f} ms  p99 {result['p99_ms']:.3f} ms  "
+                f"{result['mb_per_s']:.1f} MB/s  {result['png_bytes']} bytes",
+                file=sys.stderr
+            )
+
+    report = dict(meta=metadata(), corpus=args.corpus, results=results)
+    if args.json:
+        with open(args.json, "w") as f:
+            json.dump(report, f, indent=2)
+    else:
+        json.dump(report, sys.stdout, indent=2)
+
+    if args.baseline:
+        with open(args.baseline) as f:
+            baseline = json.load(f)
+        return compare_reports(baseline, report, args.threshold, args.size_threshold)
+    return 0
+
+def compare_reports(baseline, current, threshold, size_threshold):
+    base = { r["name"]: r for r in baseline["results"] if "error" not in r }
+    regressions = 0
+    compared = 0
+
+    for result in current["results"]:
+        name = result["name"]
+        if "error" in result:
+            print(f"ERROR       {name}  {result['error']}")
+            regressions += 1
+            continue
+        if name not in base:
+            continue
+        compared += 1
+
+        old = base[name]
+        time_ratio = result["p50_ms"] / old["p50_ms"]
+        size_ratio = result["png_bytes"] / old["png_bytes"]
+
+        if time_ratio > 1 + threshold:
+            status = "SLOWER"
+        elif size_ratio > 1 + size_threshold:
+            status = "BIGGER"
+        elif time_ratio < 1 - threshold:
+            status = "faster"
+        else:
+            continue
+
+        if status.isupper():
+            regressions += 1
+        print(
+            f"{status:10}  {name}  p50 {old['p50_ms']:.3f} -> {result['p50_ms']:.3f} ms "
+            f"({(time_ratio - 1) * 100:+.1f}%)  size {old['png_bytes']} -> {result['png_bytes']} "
+            f"({(size_ratio - 1) * 100:+.2f}%)"
+        )
+
+    missing = set(base) - set(r["name"] for r in current["results"])
+    print(f"{compared} cases compared, {regressions} regressions, {len(missing)} baseline cases not run.")
+    return 1 if regressions else 0
+
+def compare(args):
+    with open(args.baseline) as f:
+        baseline = json.load(f)
+    with open(args.current) as f:
+        current = json.load(f)
+    return compare_reports(baseline, current, args.threshold, args.size_threshold)
+
+def main():
+    parser = argparse.ArgumentParser(description="pyspng benchmark suite")
+    sub = parser.add_subparsers(dest="command", required=True)
+
+    def thresholds(p):
+        p.add_argument("--threshold", type=float, default=0.10,
+            help="Fail when the median latency grows by more than this fraction.")
+        p.add_argument("--size-threshold", type=float, default=0.01,
+            help="Fail when the compressed size grows by more than this fraction.")
+
+    p = sub.add_parser("run", help="Run the benchmarks.")
+    p.add_argument("--corpus", choices=list(CORPORA), default="quick")
+    p.add_argument("--threads", default="1,0",
+        help="Comma separated thread counts to run every case with, 0 is one per core.")
+    p.add_argument("--filter", default=None, help="Only run cases whose name contains this.")
+    p.add_argument("--min-calls", type=int, default=5)
+    p.add_argument("--min-seconds", type=float, default=0.25)
+    p.add_argument("--no-isolate", dest="isolate", action="store_false",
+        help="Run every case in this process, peak RSS becomes cumulative.")
+    p.add_argument("--json", default=None, help="Write results here instead of stdout.")
+    p.add_argument("--baseline", default=None, help="Compare against this earlier result file.")
+    thresholds(p)
+    p.set_defaults(func=run)
+
+    p = sub.add_parser("compare", help="Compare two result files.")
+    p.add_argument("baseline")
+    p.add_argument("current")
+    thresholds(p)
+    p.set_defaults(func=compare)
+
+    args = parser.parse_args()
+    return args.func(args)
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -1,12 +1,15 @@
 
+import errno
 import numpy as np
 import os
 import io
 import itertools
 import pyspng as m
 import glob
+import struct
+import zlib
 
-print ('pyspng-seunglab version', m.__version__)
+print ('pyspng-seunglab version', m.__version__, 'with', m.deflate_backend)
 
 fname = os.path.join(os.path.dirname(__file__), 'test.png')
 
@@ -18,15 +21,7 @@ def encode_test():
     dtypes = [ np.uint8, np.uint16 ]
     progressives = [0,1,2]
 
-    # channel, dtype tuples
-    unsupported = set([
-        (1, np.uint16),
-        (3, np.uint16),
-    ])
-
     for width, height, channel, dtype, progressive in itertools.product(widths, heights, channels, dtypes, progressives):
-        if (channel, dtype) in unsupported:
-            continue
         try:
             img = np.random.randint(0,255, size=(width,height,channel)).astype(dtype)
             png = m.encode(img, progressive)
@@ -115,6 +110,707 @@ def test_image_files():
     print ('')
 
 
+def test_many():
+    imgs = [
+        np.random.randint(0, 255, size=(h, w, c)).astype(np.uint8)
+        for h, w, c in itertools.product([1, 17, 64], [1, 33, 64], [1, 2, 3, 4])
+    ]
+    imgs.append(np.random.randint(0, 65535, size=(25, 31, 4)).astype(np.uint16))
+
+    for threads in [0, 1, 4]:
+        pngs = m.encode_many(imgs, compress_level=3, threads=threads)
+        assert pngs == [ m.encode(img, compress_level=3) for img in imgs ]
+
+        recovered = m.load_many(pngs, threads=threads)
+        for img, rec in zip(imgs, recovered):
+            if rec.ndim < 3:
+                rec = rec[..., np.newaxis]
+            assert np.all(img == rec)
+        print('.', end='', flush=True)
+
+    assert m.load_many([]) == []
+
+    bad = [ pngs[0], b'this is not a png', pngs[1] ]
+    try:
+        m.load_many(bad)
+        assert False, "expected an error"
+    except RuntimeError as e:
+        assert 'item 1' in str(e)
+
+    res = m.load_many(bad, errors="return")
+    assert np.all(res[0] == m.load(pngs[0]))
+    assert isinstance(res[1], RuntimeError)
+    assert np.all(res[2] == m.load(pngs[1]))
+    print('')
+
+def test_threaded_encode():
+    # big enough to be cut into several strips
+    for shape, dtype in [ ((2000, 1500, 3), np.uint8), ((1200, 1100, 4), np.uint16), ((3000, 2000), np.uint8) ]:
+        x = np.arange(np.prod(shape)).reshape(shape) // 7
+        img = (x + np.random.randint(0, 4, size=shape)).astype(dtype)
+
+        for level in [0, 6]:
+            png = m.encode(img, compress_level=level, threads=4)
+            assert np.all(m.load(png) == img)
+
+            try:
+                import PIL.Image
+                pil_img = np.array(PIL.Image.open(io.BytesIO(png)))
+                if dtype == np.uint8:
+                    assert np.all(pil_img == img)
+            except ImportError:
+                pass
+            print('.', end='', flush=True)
+    print('')
+
+def test_zero_copy():
+    img = np.random.randint(0, 255, size=(37, 41, 3)).astype(np.uint8)
+    png = m.encode(img)
+
+    for data in [ png, bytearray(png), memoryview(png), np.frombuffer(png, dtype=np.uint8) ]:
+        assert np.all(m.load(data) == img)
+        assert m.header(data)["width"] == 41
+    assert np.all(m.load_many([ bytearray(png), memoryview(png) ])[1] == img)
+
+    # slices of a larger buffer
+    assert np.all(m.load(memoryview(b'xxx' + png + b'yyy')[3:-3]) == img)
+
+    for progressive in [0, 1, 2]:
+        png = m.encode(img, progressive=progressive)
+
+        out = np.zeros((37, 41, 3), dtype=np.uint8)
+        assert m.load(png, out=out) is out
+        assert np.all(out == img)
+
+        # strided destination inside a larger volume
+        volume = np.zeros((3, 37, 41, 4), dtype=np.uint8)
+        m.load(png, out=volume[1,:,:,:3])
+        assert np.all(volume[1,:,:,:3] == img)
+        assert np.all(volume[0] == 0) and np.all(volume[2] == 0)
+        assert np.all(volume[1,:,:,3] == 0)
+
+        fortran = np.zeros((37, 41, 3), dtype=np.uint8, order='F')
+        m.load(png, out=fortran)
+        assert np.all(fortran == img)
+        print('.', end='', flush=True)
+
+    gray = np.random.randint(0, 255, size=(20, 30)).astype(np.uint8)
+    out = np.zeros((30, 20), dtype=np.uint8).T
+    m.load(m.encode(gray), out=out)
+    assert np.all(out == gray)
+
+    for bad in [ np.zeros((37, 41, 4), dtype=np.uint8), np.zeros((37, 41, 3), dtype=np.uint16) ]:
+        try:
+            m.load(png, out=bad)
+            assert False, "expected an error"
+        except ValueError:
+            pass
+
+    # non-native byte order would get native samples
+    img16 = np.random.randint(0, 65535, size=(20, 30)).astype(np.uint16)
+    swapped = np.zeros((20, 30), dtype=img16.dtype.newbyteorder())
+    try:
+        m.load(m.encode(img16), out=swapped)
+        assert False, "expected an error"
+    except ValueError:
+        pass
+
+    # anything but an ndarray would be decoded into a discarded copy
+    try:
+        m.load(m.encode(gray), out=gray.tolist())
+        assert False, "expected an error"
+    except TypeError:
+        pass
+    print('')
+
+def test_region():
+    for shape in [ (1, 1), (9, 1), (1, 9), (37, 41), (37, 41, 2), (64, 50, 3), (30, 20, 4) ]:
+        for dtype in [ np.uint8, np.uint16 ]:
+            img = np.random.randint(0, np.iinfo(dtype).max, size=shape).astype(dtype)
+            for progressive in [0, 2]:
+                png = m.encode(img, progressive=progressive)
+                h, w = shape[:2]
+                for _ in range(10):
+                    y0 = np.random.randint(0, h)
+                    y1 = np.random.randint(y0 + 1, h + 1)
+                    x0 = np.random.randint(0, w)
+                    x1 = np.random.randint(x0 + 1, w + 1)
+
+                    crop = m.load(png, region=(y0, y1, x0, x1))
+                    assert crop.flags.c_contiguous
+                    assert np.all(crop == img[y0:y1, x0:x1])
+
+                    out = np.zeros((y1 - y0, x1 - x0) + shape[2:], dtype=dtype, order='F')
+                    m.load(png, out=out, region=(y0, y1, x0, x1))
+                    assert np.all(out == img[y0:y1, x0:x1])
+                print('.', end='', flush=True)
+
+    png = m.encode(np.zeros((10, 10), dtype=np.uint8))
+    for bad in [ (0, 0, 0, 10), (0, 11, 0, 10), (5, 4, 0, 10), (0, 10, 3, 3), (-1, 5, 0, 5), (0, 10) ]:
+        try:
+            m.load(png, region=bad)
+            assert False, "expected an error"
+        except ValueError:
+            pass
+    print('')
+
+def test_files():
+    import io
+    import os
+    import tempfile
+
+    img = np.random.randint(0, 255, size=(300, 200, 3)).astype(np.uint8)
+    with tempfile.TemporaryDirectory() as tmpdir:
+        path = os.path.join(tmpdir, "test.png")
+        for progressive in [0, 1, 2]:
+            for threads in [1, 4]:
+                m.save_file(path, img, progressive=progressive, threads=threads)
+                assert np.all(m.load_file(path) == img)
+                with open(path, "rb") as f:
+                    assert f.read() == m.encode(img, progressive=progressive, threads=threads)
+                with open(path, "rb") as f:
+                    assert np.all(m.load_file(f) == img)
+
+                buf = io.BytesIO()
+                m.save_file(buf, img, progressive=progressive, threads=threads)
+                assert buf.getvalue() == m.encode(img, progressive=progressive, threads=threads)
+                buf.seek(0)
+                assert np.all(m.load_file(buf, region=(10, 20, 30, 40)) == img[10:20, 30:40])
+                print('.', end='', flush=True)
+
+        out = np.zeros((200, 300, 3), dtype=np.uint8).transpose(1, 0, 2)
+        assert m.load_file(path, out=out) is out
+        assert np.all(out == img)
+
+        missing = os.path.join(tmpdir, "nonexistent.png")
+        try:
+            m.load_file(missing)
+            assert False, "expected an error"
+        except FileNotFoundError as err:
+            assert err.errno == errno.ENOENT and err.filename == missing
+
+        unwritable = os.path.join(tmpdir, "nonexistent", "out.png")
+        try:
+            m.save_file(unwritable, img)
+            assert False, "expected an error"
+        except OSError as err:
+            assert err.errno == errno.ENOENT and err.filename == unwritable
+
+        with open(path, "rb") as f:
+            truncated = io.BytesIO(f.read()[:1000])
+        try:
+            m.load_file(truncated)
+            assert False, "expected an error"
+        except RuntimeError:
+            pass
+
+    # exceptions from file objects propagate unchanged
+    class BrokenFile:
+        def read(self, n):
+            raise IOError("broken read")
+        def write(self, data):
+            raise IOError("broken write")
+
+    for fn in [ lambda: m.load_file(BrokenFile()), lambda: m.save_file(BrokenFile(), img) ]:
+        try:
+            fn()
+            assert False, "expected an error"
+        except IOError as err:
+            assert "broken" in str(err)
+
+    # writes that make no progress raise instead of looping forever
+    class StuckFile:
+        def write(self, data):
+            return 0
+
+    class WouldBlockFile(io.RawIOBase):
+        def writable(self):
+            return True
+        def write(self, data):
+            return None
+
+    for f, error in [ (StuckFile(), OSError), (WouldBlockFile(), BlockingIOError) ]:
+        try:
+            m.save_file(f, img)
+            assert False, "expected an error"
+        except error:
+            pass
+
+    # other objects may return nothing once all of it is written
+    class ListFile:
+        def __init__(self):
+            self.parts = []
+        def write(self, data):
+            self.parts.append(bytes(data))
+
+    f = ListFile()
+    m.save_file(f, img)
+    assert b''.join(f.parts) == m.encode(img)
+    print('')
+
+def test_incremental():
+    img = np.random.randint(0, 255, size=(200, 150, 3)).astype(np.uint8)
+    img[:, :, 0] = np.arange(150)
+
+    for progressive in [0, 1, 2]:
+        png = m.encode(img, progressive=progressive)
+
+        decoder = m.IncrementalDecoder()
+        assert decoder.header is None
+        assert decoder.partial_image() is None
+        assert decoder.rows_complete == 0
+
+        last_rows = 0
+        for i in range(0, len(png), 1000):
+            decoder.feed(png[i:i+1000])
+            rows = decoder.rows_complete
+            assert rows >= last_rows
+            if rows > 0:
+                assert decoder.header["width"] == 150
+                assert np.all(decoder.partial_image()[:rows] == img[:rows])
+            last_rows = rows
+
+        assert np.all(decoder.finish() == img)
+        assert decoder.done
+        assert decoder.rows_complete == 200
+        print('.', end='', flush=True)
+
+    gray = np.random.randint(0, 255, size=(20, 30)).astype(np.uint8)
+    decoder = m.IncrementalDecoder()
+    decoder.feed(memoryview(m.encode(gray)))
+    assert np.all(decoder.finish() == gray)
+
+    try:
+        decoder.feed(b'more')
+        assert False, "expected an error"
+    except RuntimeError:
+        pass
+
+    decoder = m.IncrementalDecoder()
+    decoder.feed(png[:len(png) // 2])
+    try:
+        decoder.finish()
+        assert False, "expected an error"
+    except RuntimeError as err:
+        assert 'could not decode' in str(err)
+
+    # abandoned mid stream
+    decoder = m.IncrementalDecoder()
+    decoder.feed(png[:100])
+    del decoder
+    print('')
+
+def test_max_pass():
+    grids = [ (8, 8), (8, 4), (4, 4), (4, 2), (2, 2), (2, 1), (1, 1) ]
+
+    for shape in [ (1, 1), (7, 9), (37, 41), (37, 41, 3), (20, 33, 4) ]:
+        img = np.random.randint(0, 255, size=shape).astype(np.uint8)
+        for progressive in [0, 2]:
+            png = m.encode(img, progressive=progressive)
+            for k, (sy, sx) in enumerate(grids, start=1):
+                assert np.all(m.load(png, max_pass=k) == img[::sy, ::sx])
+
+                filled = m.load(png, max_pass=k, nearest_fill=True)
+                assert filled.shape == img.shape
+                ys = np.arange(shape[0]) // sy * sy
+                xs = np.arange(shape[1]) // sx * sx
+                assert np.all(filled == img[ys][:, xs])
+            print('.', end='', flush=True)
+
+    img = np.random.randint(0, 65535, size=(50, 60, 4)).astype(np.uint16)
+    png = m.encode(img, progressive=2)
+    assert np.all(m.load(png, max_pass=3) == img[::4, ::4])
+    assert np.all(m.load_file(io.BytesIO(png), max_pass=3) == img[::4, ::4])
+
+    for kwargs in [ dict(max_pass=0), dict(max_pass=8), dict(max_pass=1, region=(0, 1, 0, 1)) ]:
+        try:
+            m.load(png, **kwargs)
+            assert False, "expected an error"
+        except ValueError:
+            pass
+    print('')
+
+def row_filters(png, rowbytes):
+    # filter type byte of every row of a non-interlaced PNG
+    pos = 8
+    idat = b''
+    while pos < len(png):
+        length, kind = struct.unpack('>I4s', png[pos:pos+8])
+        if kind == b'IDAT':
+            idat += png[pos+8:pos+8+length]
+        pos += length + 12
+    raw = zlib.decompress(idat)
+    return set(raw[::rowbytes + 1])
+
+def test_encode_options():
+    shape = (300, 400, 3)
+    y, x = np.mgrid[:shape[0], :shape[1]]
+    img = np.stack([ x, y, x + y ], axis=2) // 3
+    img = (img + np.random.randint(0, 3, size=shape)).astype(np.uint8)
+    rowbytes = shape[1] * shape[2]
+
+    for name, ftype in [ ("none", 0), ("sub", 1), ("up", 2), ("avg", 3), ("paeth", 4) ]:
+        for threads in [1, 4]:
+            png = m.encode(img, filter=name, threads=threads)
+            assert np.all(m.load(png) == img)
+            assert row_filters(png, rowbytes) == { ftype }
+
+    png = m.encode(img, filter="fast")
+    assert np.all(m.load(png) == img)
+    assert len(row_filters(png, rowbytes)) == 1
+
+    # every strip of the threaded encoder uses the same filter
+    big = np.tile(img, (4, 3, 1))
+    png = m.encode(big, filter="fast", threads=4)
+    assert np.all(m.load(png) == big)
+    assert len(row_filters(png, big.shape[1] * 3)) == 1
+
+    png = m.encode(img, filter=["up", "none"])
+    assert row_filters(png, rowbytes) <= { 0, 2 }
+    print('.', end='', flush=True)
+
+    for dtype in [ np.uint8, np.uint16 ]:
+        img2 = img.astype(dtype)[:, :, :2] * (257 if dtype == np.uint16 else 1)
+        for progressive in [0, 1, 2]:
+            for kwargs in [
+                dict(filter="fast"), dict(filter="all", strategy="rle"),
+                dict(strategy="huffman"), dict(strategy="fixed", compress_level=1),
+                dict(filter="paeth", strategy="default", mem_level=9),
+                dict(compress_level=0, filter="fast", mem_level=1),
+            ]:
+                png = m.encode(img2, progressive=progressive, **kwargs)
+                assert np.all(m.load(png) == img2)
+        print('.', end='', flush=True)
+
+    binaries = m.encode_many([ img, img[::2] ], filter="fast", strategy="filtered")
+    assert np.all(m.load(binaries[1]) == img[::2])
+
+    buf = io.BytesIO()
+    m.save_file(buf, img, filter="sub", strategy="rle", mem_level=4)
+    assert np.all(m.load(buf.getvalue()) == img)
+    assert row_filters(buf.getvalue(), rowbytes) == { 1 }
+
+    for kwargs in [
+        dict(filter="median"), dict(filter=[]), dict(filter=["fast", "up"]),
+        dict(strategy="lz4"), dict(mem_level=0), dict(mem_level=10), dict(window_bits=7),
+    ]:
+        # encode_many raises once instead of returning an error per image
+        for fn in [ lambda: m.encode(img, **kwargs), lambda: m.encode_many([ img, img ], errors="return", **kwargs) ]:
+            try:
+                fn()
+                assert False, "expected an error"
+            except ValueError:
+                pass
+    print('')
+
+def split_idat(png):
+    # (bytes before the first IDAT, IDAT data, bytes from IEND on)
+    pos = 8
+    head = tail = None
+    idat = b''
+    while pos < len(png):
+        length, kind = struct.unpack('>I4s', png[pos:pos+8])
+        if kind == b'IDAT':
+            if head is None:
+                head = png[:pos]
+            idat += png[pos+8:pos+8+length]
+        elif head is not None and tail is None:
+            tail = png[pos:]
+        pos += length + 12
+    return head, idat, tail
+
+def join_idat(head, idat, tail, chunk_size):
+    chunks = [ head ]
+    for i in range(0, len(idat), chunk_size):
+        data = idat[i:i+chunk_size]
+        crc = zlib.crc32(b'IDAT' + data) & 0xffffffff
+        chunks.append(struct.pack('>I4s', len(data), b'IDAT') + data + struct.pack('>I', crc))
+    chunks.append(tail)
+    return b''.join(chunks)
+
+def unfilter(raw, height, rowbytes, bpp):
+    # plain PNG reconstruction, independent of libspng
+    out = np.zeros((height, rowbytes), dtype=np.int64)
+    prev = np.zeros(rowbytes, dtype=np.int64)
+    for y in range(height):
+        start = y * (rowbytes + 1)
+        ftype = raw[start]
+        line = np.frombuffer(raw, dtype=np.uint8, count=rowbytes, offset=start + 1).astype(np.int64)
+        cur = np.zeros(rowbytes, dtype=np.int64)
+        for i in range(rowbytes):
+            a = cur[i - bpp] if i >= bpp else 0
+            b = prev[i]
+            c = prev[i - bpp] if i >= bpp else 0
+            if ftype == 0:
+                pred = 0
+            elif ftype == 1:
+                pred = a
+            elif ftype == 2:
+                pred = b
+            elif ftype == 3:
+                pred = (a + b) // 2
+            else:
+                p = a + b - c
+                pa, pb, pc = abs(p - a), abs(p - b), abs(p - c)
+                pred = a if (pa <= pb and pa <= pc) else (b if pb <= pc else c)
+            cur[i] = (line[i] + pred) & 0xff
+        out[y] = cur
+        prev = cur
+    return out.astype(np.uint8)
+
+def test_deflate_backends():
+    # Python's zlib stands in for a second backend: whatever this build
+    # uses has to produce streams zlib inflates to the same rows and
+    # decode anything zlib deflates to the same pixels.
+    img = np.random.randint(0, 255, size=(23, 31, 3)).astype(np.uint8)
+    img[:, :15] = np.arange(15 * 3).reshape(15, 3) # compressible part
+    rowbytes = img.shape[1] * img.shape[2]
+
+    for kwargs in [
+        dict(compress_level=0), dict(filter="none"), dict(filter="all", compress_level=9),
+        dict(filter="paeth", strategy="rle"), dict(filter="fast", strategy="huffman"),
+        dict(filter="avg", strategy="fixed"), dict(mem_level=1, compress_level=1),
+    ]:
+        png = m.encode(img, **kwargs)
+        head, idat, tail = split_idat(png)
+        raw = zlib.decompress(idat)
+        assert np.all(unfilter(raw, img.shape[0], rowbytes, 3) == img.reshape(img.shape[0], rowbytes))
+    print('.', end='', flush=True)
+
+    png = m.encode(img, filter="all")
+    head, idat, tail = split_idat(png)
+    raw = zlib.decompress(idat)
+
+    strategies = [ zlib.Z_DEFAULT_STRATEGY, zlib.Z_FILTERED, zlib.Z_HUFFMAN_ONLY, zlib.Z_RLE, zlib.Z_FIXED ]
+    for level, wbits, mem_level, strategy in itertools.product([0, 1, 6, 9], [9, 12, 15], [1, 9], strategies):
+        zobj = zlib.compressobj(level, zlib.DEFLATED, wbits, mem_level, strategy)
+        idat2 = zobj.compress(raw) + zobj.flush()
+        for chunk_size in [ 7, 1 << 20 ]:
+            png2 = join_idat(head, idat2, tail, chunk_size)
+            assert np.all(m.load(png2) == img)
+    print('.', end='', flush=True)
+
+    # deflate windows smaller than 32K need zlib
+    if m.deflate_backend.startswith("zlib"):
+        png = m.encode(img, window_bits=9)
+        assert np.all(m.load(png) == img)
+        assert zlib.decompress(split_idat(png)[1]) == zlib.decompress(idat)
+    else:
+        try:
+            m.encode(img, window_bits=9)
+            assert False, "expected an error"
+        except ValueError:
+            pass
+    print('')
+
+def test_stats():
+    shape = (300, 400, 3)
+    y, x = np.mgrid[:shape[0], :shape[1]]
+    img = np.stack([ x, y, x + y ], axis=2) // 3
+    img = (img + np.random.randint(0, 3, size=shape)).astype(np.uint8)
+    rowbytes = shape[1] * shape[2]
+
+    def check(stats, zlib_stage, filter_stage):
+        for key in [ "total_ns", "input_ns", "chunks_ns", zlib_stage, filter_stage, "convert_ns", "alloc_ns" ]:
+            assert 0 <= stats[key] <= stats["total_ns"], key
+        assert sum(stats["filters"].values()) == stats["scanlines"] == len(stats["row_filters"])
+        for name, ftype in [ ("none", 0), ("sub", 1), ("up", 2), ("avg", 3), ("paeth", 4) ]:
+            assert stats["filters"][name] == np.count_nonzero(stats["row_filters"] == ftype)
+
+    for threads in [1, 4]:
+        big = np.tile(img, (1 if threads == 1 else 16, 1, 1))
+        png, enc = m.encode(big, threads=threads, stats=True)
+        assert png == m.encode(big, threads=threads)
+        check(enc, "deflate_ns", "filter_ns")
+
+        raw = zlib.decompress(split_idat(png)[1])
+        assert list(enc["row_filters"]) == list(raw[::rowbytes + 1])
+        assert enc["scanlines"] == big.shape[0]
+        assert enc["deflated_bytes"] == len(raw)
+        assert enc["idat_bytes"] == len(split_idat(png)[1])
+        assert enc["input_bytes"] == big.nbytes
+        assert enc["output_bytes"] == len(png)
+
+        arr, dec = m.load(png, stats=True)
+        assert np.all(arr == big)
+        check(dec, "inflate_ns", "unfilter_ns")
+        assert np.all(dec["row_filters"] == enc["row_filters"])
+        assert dec["inflated_bytes"] == enc["deflated_bytes"]
+        assert dec["idat_bytes"] == enc["idat_bytes"]
+        assert dec["input_bytes"] == len(png)
+        assert dec["output_bytes"] == big.nbytes
+        print('.', end='', flush=True)
+
+    # one scanline per row of each Adam7 pass
+    png, enc = m.encode(img, progressive=m.ProgressiveMode.INTERLACED, stats=True)
+    passes = [ (0, 0, 8, 8), (4, 0, 8, 8), (0, 4, 4, 8), (2, 0, 4, 4), (0, 2, 2, 4), (1, 0, 2, 2), (0, 1, 1, 2) ]
+    assert enc["scanlines"] == sum(
+        len(range(y0, shape[0], dy)) for x0, y0, dx, dy in passes if x0 < shape[1]
+    )
+    arr, dec = m.load(png, stats=True)
+    assert np.all(arr == img)
+    assert np.all(dec["row_filters"] == enc["row_filters"])
+
+    # decoding stops at the end of the region
+    png, enc = m.encode(img, stats=True)
+    arr, dec = m.load(png, region=(0, 10, 50, 60), stats=True)
+    assert np.all(arr == img[0:10, 50:60])
+    assert np.all(dec["row_filters"] == enc["row_filters"][:10])
+    assert dec["output_bytes"] == arr.nbytes
+
+    out = np.zeros_like(img)
+    res, dec = m.load(png, out=out, stats=True)
+    assert res is out and np.all(out == img)
+    assert dec["scanlines"] == shape[0]
+    print('')
+
+def png_chunk(kind, data):
+    crc = zlib.crc32(kind + data) & 0xffffffff
+    return struct.pack('>I4s', len(data), kind) + data + struct.pack('>I', crc)
+
+def test_native16():
+    for shape in [ (1, 1), (37, 41), (64, 33, 3), (300, 257), (257, 300, 3) ]:
+        img = np.random.randint(0, 65535, size=shape).astype(np.uint16)
+        img.flat[0] = 0x1234 # byte order shows
+
+        for kwargs in [ dict(), dict(progressive=1), dict(progressive=2), dict(threads=4), dict(filter="all") ]:
+            png = m.encode(img, **kwargs)
+            assert m.header(png)["bit_depth"] == 16
+            arr = m.load(png)
+            assert arr.dtype == np.uint16 and arr.shape == shape
+            assert np.all(arr == img)
+        print('.', end='', flush=True)
+
+        # written without pyspng: the samples are big-endian, no alpha
+        h, w = shape[:2]
+        color_type = 0 if len(shape) == 2 else 2
+        raw = b''.join(b'\x00' + img[y].astype('>u2').tobytes() for y in range(h))
+        png = (
+            b'\x89PNG\r\n\x1a\n'
+            + png_chunk(b'IHDR', struct.pack('>IIBBBBB', w, h, 16, color_type, 0, 0, 0))
+            + png_chunk(b'IDAT', zlib.compress(raw))
+            + png_chunk(b'IEND', b'')
+        )
+        assert np.all(m.load(png) == img)
+        assert np.all(m.load_file(io.BytesIO(png)) == img)
+
+        head, idat, tail = split_idat(m.encode(img, filter="none", compress_level=0))
+        assert zlib.decompress(idat) == raw
+
+        y1, x1 = (h + 1) // 2, (w + 1) // 2
+        assert np.all(m.load(png, region=(0, y1, 0, x1)) == img[:y1, :x1])
+        out = np.zeros(shape, dtype=np.uint16, order='F')
+        m.load(png, out=out)
+        assert np.all(out == img)
+
+        decoder = m.IncrementalDecoder()
+        decoder.feed(png)
+        assert np.all(decoder.finish() == img)
+
+        interlaced = m.encode(img, progressive=2)
+        assert np.all(m.load(interlaced, max_pass=3) == img[::4, ::4])
+    print('')
+
+def test_reduce():
+    mask = (np.random.randint(0, 2, size=(300, 257)) * 255).astype(np.uint8)
+    levels = (np.random.randint(0, 4, size=(37, 41)) * 85).astype(np.uint8)
+    small_ints = np.random.randint(0, 4, size=(37, 41)).astype(np.uint8)
+
+    for img, bit_depth in [ (mask, 1), (levels, 2), (levels * 0 + 17, 4), (small_ints, 8) ]:
+        for kwargs in [ dict(), dict(progressive=1), dict(progressive=2), dict(threads=4, compress_level=1) ]:
+            png = m.encode(img, reduce=True, **kwargs)
+            assert m.header(png)["bit_depth"] == bit_depth
+            assert m.header(png)["color_type"] == 0
+            assert np.all(m.load(png) == img)
+        print('.', end='', flush=True)
+    assert len(m.encode(mask, reduce=True)) < len(m.encode(mask))
+
+    palette = np.random.randint(0, 255, size=(256, 4)).astype(np.uint8)
+    palette[:, 0] = np.arange(256) # distinct
+    palette[:, 3] = np.where(np.arange(256) % 3, 255, palette[:, 3])
+    for channels in [ 3, 4 ]:
+        for ncolors, bit_depth in [ (1, 1), (2, 1), (3, 2), (16, 4), (17, 8), (256, 8), (257, 8) ]:
+            labels = np.random.randint(0, ncolors, size=(61, 47))
+            labels.flat[:ncolors] = np.arange(ncolors)
+            colors = np.concatenate([ palette, palette[:1] ^ [ 0, 1, 0, 0 ] ]).astype(np.uint8)[:, :channels]
+            img = colors[labels]
+
+            png = m.encode(img, reduce=True)
+            header = m.header(png)
+            if ncolors > 256:
+                assert header["color_type"] in (2, 6)
+                try:
+                    m.load(png, raw_indices=True)
+                    assert False, "expected an error"
+                except ValueError:
+                    pass
+                continue
+
+            assert header["color_type"] == 3 and header["bit_depth"] == bit_depth
+            # palette PNGs decode to RGB, with the palette's alpha on request
+            fmt = "RGBA" if channels == 4 else None
+            assert m.load(png).shape == labels.shape + (3,)
+            assert np.all(m.load(png) == img[..., :3])
+            assert np.all(m.load(png, format=fmt) == img)
+            assert np.all(m.load(png, format=fmt, region=(5, 20, 3, 40)) == img[5:20, 3:40])
+            assert np.all(m.load(m.encode(img, reduce=True, progressive=2), format=fmt, max_pass=2) == img[::8, ::4])
+
+            indices, plte = m.load(png, raw_indices=True)
+            assert indices.dtype == np.uint8 and indices.shape == labels.shape
+            assert plte.dtype == np.uint8 and len(plte) == ncolors
+            assert plte.shape[1] == (4 if np.any(img[..., 3:] != 255) else 3)
+            assert np.all(plte[indices][..., :channels] == img)
+
+            decoder = m.IncrementalDecoder(format=fmt)
+            decoder.feed(png)
+            assert np.all(decoder.finish() == img)
+            print('.', end='', flush=True)
+
+    # unchanged: 16-bit, gray + alpha
+    for img in [ np.zeros((9, 7), dtype=np.uint16), np.zeros((9, 7, 2), dtype=np.uint8) ]:
+        assert m.encode(img, reduce=True) == m.encode(img)
+
+    # big enough for the strip encoder, which like libspng
+    # leaves palette indices and packed rows unfiltered
+    y, x = np.mgrid[:2048, :2048]
+    labels = (x // 8 + y // 8) % 17
+    for big, rowbytes in [ (colors[labels][..., :3], 2048), ((labels % 16 * 17).astype(np.uint8), 1024) ]:
+        for threads in [ 1, 4 ]:
+            big_png = m.encode(big, reduce=True, threads=threads)
+            assert row_filters(big_png, rowbytes) == { 0 }
+            assert np.all(m.load(big_png) == big)
+    print('.', end='', flush=True)
+
+    binaries = m.encode_many([ mask, img ], reduce=True)
+    assert m.header(binaries[0])["bit_depth"] == 1
+    f = io.BytesIO()
+    m.save_file(f, mask, reduce=True)
+    assert f.getvalue() == m.encode(mask, reduce=True)
+
+    for kwargs in [ dict(region=(0, 1, 0, 1)), dict(format="RGB"), dict(stats=True) ]:
+        try:
+            m.load(png, raw_indices=True, **kwargs)
+            assert False, "expected an error"
+        except ValueError:
+            pass
+
+    try:
+        import PIL.Image
+    except ImportError:
+        print('')
+        return
+
+    # written by another encoder
+    labels = np.random.randint(0, 5, size=(30, 20)).astype(np.uint8)
+    pimg = PIL.Image.frombytes('P', (20, 30), labels.tobytes())
+    pimg.putpalette(list(range(15)) + [ 0 ] * (768 - 15))
+    f = io.BytesIO()
+    pimg.save(f, format='PNG', bits=4)
+    indices, plte = m.load(f.getvalue(), raw_indices=True)
+    assert np.all(indices == np.array(pimg))
+    assert np.all(m.load(f.getvalue()) == np.array(pimg.convert('RGB')))
+    print('')
+
 def ref_compare(fn, spngarr):
     try:
         import PIL.Image
@@ -144,5 +840,29 @@ encode_test()
 print ('\ntesting decoding', end='')
 synthetic_decode_test()
 test_image_files()
+print ('testing batch encoding/decoding', end='')
+test_many()
+print ('testing threaded encoding', end='')
+test_threaded_encode()
+print ('testing zero copy buffers', end='')
+test_zero_copy()
+print ('testing region decoding', end='')
+test_region()
+print ('testing file streaming', end='')
+test_files()
+print ('testing incremental decoding', end='')
+test_incremental()
+print ('testing adam7 previews', end='')
+test_max_pass()
+print ('testing encode options', end='')
+test_encode_options()
+print ('testing deflate backends', end='')
+test_deflate_backends()
+print ('testing stats', end='')
+test_stats()
+print ('testing 16-bit gray and rgb', end='')
+test_native16()
+print ('testing palette and low bit depth encoding', end='')
+test_reduce()
 
 print ('All tests ok.')